@@ -0,0 +1,125 @@
+/**
+ *  Contention benchmark of ConcurrentSet against Set behind one
+ *  std::shared_mutex, from 1 to TREE_BENCH_MAX_THREADS threads, or all
+ *  hardware threads. Every thread runs a mix of contains, insert and erase
+ *  of random keys on one shared set, prefilled with half of the keys, so
+ *  its size stays about the same. Names look like
+ *  "read_mostly/ConcurrentSet/real_time/threads:8".
+ *
+ *  Mixes give the percentages of contains, insert and erase: read_only is
+ *  100/0/0, read_mostly 90/5/5 and write_heavy 50/25/25.
+ *
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+#include "concurrent_set.h"
+#include "tree.h"
+
+#ifndef TREE_BENCH_MAX_THREADS
+#define TREE_BENCH_MAX_THREADS 0
+#endif
+
+namespace {
+
+constexpr uint64_t KEYS = 1 << 20;
+
+struct LockedSet {
+    bool insert(uint64_t key) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        return set.insert(key).second;
+    }
+
+    bool erase(uint64_t key) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        if (!set.contains(key)) {
+            return false;
+        }
+        set.erase(key);
+        return true;
+    }
+
+    bool contains(uint64_t key) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return set.contains(key);
+    }
+
+    mutable std::shared_mutex mutex;
+    Set<uint64_t> set;
+};
+
+// Returns the shared set, prefilled with even keys on first use.
+template<class S>
+S& shared_set() {
+    static S* s = []() {
+        S* res = new S;
+        for (uint64_t key = 0; key < KEYS; key += 2) {
+            res->insert(key);
+        }
+        return res;
+    }();
+    return *s;
+}
+
+template<class S>
+void bm_mix(benchmark::State& state, int reads, int inserts) {
+    S& s = shared_set<S>();
+    std::mt19937_64 gen(state.thread_index());
+    uint64_t found = 0;
+    for (auto _ : state) {
+        uint64_t key = gen() % KEYS;
+        int op = static_cast<int>(gen() % 100);
+        if (op < reads) {
+            found += s.contains(key);
+        } else if (op < reads + inserts) {
+            found += s.insert(key);
+        } else {
+            found += s.erase(key);
+        }
+    }
+    benchmark::DoNotOptimize(found);
+    state.SetItemsProcessed(int64_t(state.iterations()));
+}
+
+template<class S>
+void register_set(const char* name) {
+    int max_threads = TREE_BENCH_MAX_THREADS;
+    if (max_threads == 0) {
+        max_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    struct Mix {
+        const char* name;
+        int reads;
+        int inserts;
+    };
+    for (Mix mix : {Mix{"read_only", 100, 0}, Mix{"read_mostly", 90, 5},
+                    Mix{"write_heavy", 50, 25}}) {
+        std::string full = std::string(mix.name) + "/" + name;
+        benchmark::RegisterBenchmark(full.c_str(), bm_mix<S>, mix.reads,
+                                     mix.inserts)
+            ->ThreadRange(1, max_threads)
+            ->UseRealTime();
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    register_set<ConcurrentSet<uint64_t>>("ConcurrentSet");
+    register_set<LockedSet>("Set+shared_mutex");
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,426 @@
+/**
+ *  Benchmarks of Set against std::set and absl::btree_set, when Abseil is
+ *  found. Every operation runs for int, uint64_t and std::string keys, in
+ *  random, sorted and skewed (Zipf) order, at 1e3 keys and every power of ten
+ *  up to TREE_BENCH_MAX_KEYS. Names look like
+ *  "find/Set/uint64_t/zipf/1000000", so --benchmark_filter picks a column of
+ *  the comparison.
+ *
+ *  All containers allocate through CountingAllocator, and bytes_per_key is
+ *  the memory of nodes per key after the keys are inserted. Heap buffers of
+ *  long strings are not counted.
+ *
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "tree.h"
+
+#ifdef TREE_BENCH_ABSL
+#include <absl/container/btree_set.h>
+#endif
+
+#ifndef TREE_BENCH_MAX_KEYS
+#define TREE_BENCH_MAX_KEYS 1000000
+#endif
+
+namespace {
+
+// Bytes allocated by all CountingAllocators and not freed yet.
+size_t allocated_bytes = 0;
+
+template<class T>
+struct CountingAllocator {
+    using value_type = T;
+
+    CountingAllocator() = default;
+
+    template<class U>
+    CountingAllocator(const CountingAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        allocated_bytes += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        allocated_bytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    template<class U>
+    bool operator==(const CountingAllocator<U>&) const {
+        return true;
+    }
+
+    template<class U>
+    bool operator!=(const CountingAllocator<U>&) const {
+        return false;
+    }
+};
+
+enum class Order { RANDOM, SORTED, ZIPF };
+
+const char* order_name(Order order) {
+    switch (order) {
+        case Order::RANDOM:
+            return "random";
+        case Order::SORTED:
+            return "sorted";
+        default:
+            return "zipf";
+    }
+}
+
+template<class K>
+struct KeyName;
+
+template<>
+struct KeyName<int> {
+    static constexpr const char* value = "int";
+};
+
+template<>
+struct KeyName<uint64_t> {
+    static constexpr const char* value = "uint64_t";
+};
+
+template<>
+struct KeyName<std::string> {
+    static constexpr const char* value = "string";
+};
+
+// Spreads ranks over the key space, so neighbouring ranks aren't neighbouring
+// keys.
+uint64_t scatter(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+template<class K>
+K make_key(uint64_t x) {
+    if constexpr (std::is_same_v<K, std::string>) {
+        // Longer than the small string buffer, like typical string keys.
+        std::string key = std::to_string(x);
+        return std::string(20 - std::min<size_t>(key.size(), 20), '0') + key;
+    } else {
+        return static_cast<K>(x & (std::is_same_v<K, int> ? 0x7fffffff
+                                                          : ~uint64_t(0)));
+    }
+}
+
+/**
+ *  Ranks in [0, n) with Zipf distribution of exponent 0.99, drawn by the
+ *  method of Gray et al., "Quickly generating billion-record synthetic
+ *  databases", as in YCSB. Rank 0 is the most frequent.
+ *
+ */
+
+class Zipf {
+  public:
+    explicit Zipf(uint64_t n) : n_(n) {
+        for (uint64_t i = 1; i <= n; ++i) {
+            zeta_n_ += 1 / std::pow(double(i), THETA);
+        }
+        double zeta_2 = 1 + 1 / std::pow(2.0, THETA);
+        alpha_ = 1 / (1 - THETA);
+        eta_ = (1 - std::pow(2.0 / n, 1 - THETA)) / (1 - zeta_2 / zeta_n_);
+    }
+
+    template<class Gen>
+    uint64_t operator()(Gen& gen) {
+        double u = std::uniform_real_distribution<double>(0, 1)(gen);
+        double uz = u * zeta_n_;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, THETA)) {
+            return std::min<uint64_t>(1, n_ - 1);
+        }
+        return std::min<uint64_t>(
+            n_ - 1, uint64_t(n_ * std::pow(eta_ * u - eta_ + 1, alpha_)));
+    }
+
+  private:
+    static constexpr double THETA = 0.99;
+
+    uint64_t n_;
+    double zeta_n_ = 0;
+    double alpha_ = 0;
+    double eta_ = 0;
+};
+
+// Returns n keys in the given order. Zipf keys repeat, hot keys are spread
+// over the key space.
+template<class K>
+std::vector<K> make_keys(size_t n, Order order, uint64_t seed) {
+    std::mt19937_64 gen(seed);
+    std::vector<uint64_t> raw(n);
+    if (order == Order::ZIPF) {
+        Zipf zipf(n);
+        for (uint64_t& x : raw) {
+            x = scatter(zipf(gen) + 1);
+        }
+    } else {
+        for (uint64_t& x : raw) {
+            x = gen();
+        }
+    }
+    std::vector<K> keys;
+    keys.reserve(n);
+    for (uint64_t x : raw) {
+        keys.push_back(make_key<K>(x));
+    }
+    if (order == Order::SORTED) {
+        std::sort(keys.begin(), keys.end());
+    }
+    return keys;
+}
+
+// Returns the keys, reordered like order: shuffled, sorted or drawn with
+// Zipf distribution of ranks, the hottest ones being scattered.
+template<class K>
+std::vector<K> make_queries(std::vector<K> keys, Order order, uint64_t seed) {
+    std::mt19937_64 gen(seed);
+    if (order == Order::SORTED) {
+        std::sort(keys.begin(), keys.end());
+    } else if (order == Order::RANDOM) {
+        std::shuffle(keys.begin(), keys.end(), gen);
+    } else {
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        Zipf zipf(keys.size());
+        std::vector<K> queries;
+        queries.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            queries.push_back(keys[scatter(zipf(gen)) % keys.size()]);
+        }
+        return queries;
+    }
+    return keys;
+}
+
+// Keys and queries of one benchmark, made once for all containers.
+template<class K>
+const std::pair<std::vector<K>, std::vector<K>>& data(size_t n, Order order) {
+    static std::map<std::pair<size_t, Order>,
+                    std::pair<std::vector<K>, std::vector<K>>>
+        cache;
+    auto it = cache.find({n, order});
+    if (it == cache.end()) {
+        std::vector<K> keys = make_keys<K>(n, order, n);
+        std::vector<K> queries = make_queries(keys, order, n + 1);
+        it = cache.emplace(std::make_pair(n, order),
+                           std::make_pair(std::move(keys), std::move(queries)))
+                 .first;
+    }
+    return it->second;
+}
+
+template<class K>
+using TreeSet = Set<K, std::less<K>, CountingAllocator<K>>;
+
+template<class K>
+using WideSet = BasicSet<K, 8, 16, std::less<K>, CountingAllocator<K>>;
+
+template<class K>
+using StdSet = std::set<K, std::less<K>, CountingAllocator<K>>;
+
+#ifdef TREE_BENCH_ABSL
+template<class K>
+using AbslSet = absl::btree_set<K, std::less<K>, CountingAllocator<K>>;
+#endif
+
+template<class C, class K>
+C build(const std::vector<K>& keys) {
+    C c;
+    for (const K& key : keys) {
+        c.insert(key);
+    }
+    return c;
+}
+
+template<class C, class K>
+void bm_insert(benchmark::State& state, size_t n, Order order) {
+    const auto& [keys, queries] = data<K>(n, order);
+    size_t bytes = 0;
+    size_t size = 0;
+    for (auto _ : state) {
+        size_t before = allocated_bytes;
+        auto c = std::make_unique<C>();
+        for (const K& key : keys) {
+            c->insert(key);
+        }
+        bytes = allocated_bytes - before;
+        size = c->size();
+        state.PauseTiming();
+        c.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(int64_t(state.iterations()) *
+                            int64_t(keys.size()));
+    // Per distinct key, which Zipf keys repeat.
+    state.counters["bytes_per_key"] =
+        size == 0 ? 0 : double(bytes) / double(size);
+}
+
+template<class C, class K>
+void bm_erase(benchmark::State& state, size_t n, Order order) {
+    const auto& [keys, queries] = data<K>(n, order);
+    for (auto _ : state) {
+        state.PauseTiming();
+        C c = build<C>(keys);
+        state.ResumeTiming();
+        for (const K& key : queries) {
+            c.erase(key);
+        }
+        benchmark::DoNotOptimize(c.size());
+        state.PauseTiming();
+        c = C();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(int64_t(state.iterations()) *
+                            int64_t(queries.size()));
+}
+
+template<class C, class K>
+void bm_find(benchmark::State& state, size_t n, Order order) {
+    const auto& [keys, queries] = data<K>(n, order);
+    C c = build<C>(keys);
+    for (auto _ : state) {
+        size_t found = 0;
+        for (const K& key : queries) {
+            found += (c.find(key) != c.end());
+        }
+        benchmark::DoNotOptimize(found);
+    }
+    state.SetItemsProcessed(int64_t(state.iterations()) *
+                            int64_t(queries.size()));
+}
+
+template<class C, class K>
+void bm_lower_bound(benchmark::State& state, size_t n, Order order) {
+    const auto& [keys, queries] = data<K>(n, order);
+    C c = build<C>(keys);
+    // Most of the searched keys aren't in the set.
+    std::vector<K> missing = make_keys<K>(queries.size(), order, n + 2);
+    for (auto _ : state) {
+        size_t found = 0;
+        for (const K& key : missing) {
+            found += (c.lower_bound(key) != c.end());
+        }
+        benchmark::DoNotOptimize(found);
+    }
+    state.SetItemsProcessed(int64_t(state.iterations()) *
+                            int64_t(missing.size()));
+}
+
+template<class C, class K>
+void bm_iterate(benchmark::State& state, size_t n, Order order) {
+    const auto& [keys, queries] = data<K>(n, order);
+    C c = build<C>(keys);
+    for (auto _ : state) {
+        for (const K& key : c) {
+            benchmark::DoNotOptimize(&key);
+        }
+    }
+    state.SetItemsProcessed(int64_t(state.iterations()) * int64_t(c.size()));
+}
+
+template<class C, class K>
+void bm_copy(benchmark::State& state, size_t n, Order order) {
+    const auto& [keys, queries] = data<K>(n, order);
+    C c = build<C>(keys);
+    for (auto _ : state) {
+        auto copy = std::make_unique<C>(c);
+        benchmark::DoNotOptimize(copy->size());
+        state.PauseTiming();
+        copy.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(int64_t(state.iterations()) * int64_t(c.size()));
+}
+
+// Walks RANGE_LENGTH keys from the lower bound of every query.
+template<class C, class K>
+void bm_range_scan(benchmark::State& state, size_t n, Order order) {
+    static constexpr size_t RANGE_LENGTH = 100;
+    const auto& [keys, queries] = data<K>(n, order);
+    C c = build<C>(keys);
+    size_t scans = std::min<size_t>(queries.size(), 10000);
+    for (auto _ : state) {
+        for (size_t i = 0; i < scans; ++i) {
+            auto it = c.lower_bound(queries[i]);
+            for (size_t j = 0; j < RANGE_LENGTH && it != c.end(); ++j, ++it) {
+                benchmark::DoNotOptimize(&*it);
+            }
+        }
+    }
+    state.SetItemsProcessed(int64_t(state.iterations()) *
+                            int64_t(scans * RANGE_LENGTH));
+}
+
+template<class C, class K>
+void register_container(const char* container) {
+    using Bench = void (*)(benchmark::State&, size_t, Order);
+    const std::pair<const char*, Bench> ops[] = {
+        {"insert", bm_insert<C, K>},
+        {"erase", bm_erase<C, K>},
+        {"find", bm_find<C, K>},
+        {"lower_bound", bm_lower_bound<C, K>},
+        {"iterate", bm_iterate<C, K>},
+        {"copy", bm_copy<C, K>},
+        {"range_scan", bm_range_scan<C, K>},
+    };
+    for (const auto& [op, bench] : ops) {
+        for (Order order : {Order::RANDOM, Order::SORTED, Order::ZIPF}) {
+            for (size_t n = 1000; n <= size_t(TREE_BENCH_MAX_KEYS); n *= 10) {
+                std::string name = std::string(op) + "/" + container + "/" +
+                                   KeyName<K>::value + "/" +
+                                   order_name(order) + "/" +
+                                   std::to_string(n);
+                benchmark::RegisterBenchmark(name.c_str(), bench, n, order)
+                    ->Unit(benchmark::kMillisecond);
+            }
+        }
+    }
+}
+
+template<class K>
+void register_key() {
+    register_container<TreeSet<K>, K>("Set");
+    register_container<WideSet<K>, K>("Set8_16");
+    register_container<StdSet<K>, K>("std::set");
+#ifdef TREE_BENCH_ABSL
+    register_container<AbslSet<K>, K>("absl::btree_set");
+#endif
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    register_key<int>();
+    register_key<uint64_t>();
+    register_key<std::string>();
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
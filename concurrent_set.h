@@ -0,0 +1,710 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "epoch.h"
+#include "tree.h"
+
+/**
+ *  A sorted set of unique keys, which can be used by many threads at once.
+ *  It's a B+ tree with optimistic lock coupling: every node has a version
+ *  lock, readers never write nodes and only check that the versions of the
+ *  nodes they went through did not change, and writers lock just the nodes
+ *  they modify, i.e. a leaf, or a full node and its parent on split.
+ *  Full nodes are split on the way down, so a split never climbs up. The
+ *  only stores of a reader go to its thread's own EpochDomain record, which
+ *  other readers don't touch.
+ *
+ *  Erased keys leave their leaves underfull. A leaf losing its last key is
+ *  unlinked, unless it's the first son of its parent, and retired to an
+ *  EpochDomain, which frees it when no operation can hold a pointer to it.
+ *  Other nodes are freed only by the destructor.
+ *
+ *  Keys are read while writers may change them, so they are kept in atomics
+ *  and must be trivially copyable, and small enough for the atomics to be
+ *  lock free, which is usually at most 8 bytes.
+ *
+ *  @tparam T          Type of key objects.
+ *  @tparam Compare    Strict weak ordering of keys.
+ *  @tparam Allocator  Allocator of keys, rebound for tree nodes.
+ *
+ */
+
+template<class T, class Compare = std::less<T>,
+         class Allocator = std::allocator<T>>
+class ConcurrentSet : private CompareHolder<Compare> {
+    static_assert(std::is_trivially_copyable_v<T> &&
+                      std::is_default_constructible_v<T>,
+                  "keys must be trivially copyable");
+    static_assert(std::atomic<T>::is_always_lock_free,
+                  "atomic keys must be lock free");
+
+  private:
+    // Max number of keys in a node. Internal nodes have one son more.
+    static constexpr size_t NODE_SIZE = 15;
+
+    // Version lock: odd version means locked node, every unlock makes the
+    // version greater. Unlinked nodes stay locked with OBSOLETE version.
+    struct Node {
+        explicit Node(bool is_leaf) : leaf(is_leaf) {}
+
+        // Waits while node is locked and returns its version.
+        uint64_t read_lock() const;
+
+        // Checks that node is not changed since it had the version.
+        bool validate(uint64_t version) const;
+
+        // Locks node if it still has the version.
+        bool upgrade(uint64_t version);
+
+        void unlock();
+
+        // Unlocks node, which is unlinked, so it can't be locked anymore.
+        void unlock_obsolete();
+
+        static constexpr uint64_t OBSOLETE = UINT64_MAX;
+
+        std::atomic<uint64_t> version{0};
+        std::atomic<size_t> count{0};
+        const bool leaf;
+    };
+
+    struct Leaf : Node {
+        Leaf() : Node(true) {}
+
+        std::array<std::atomic<T>, NODE_SIZE> keys;
+        std::atomic<Leaf*> next{nullptr};
+    };
+
+    // Son i holds keys not greater than keys[i] and greater than
+    // keys[i - 1].
+    struct Inner : Node {
+        Inner() : Node(false) {}
+
+        std::array<std::atomic<T>, NODE_SIZE> keys;
+        std::array<std::atomic<Node*>, NODE_SIZE + 1> sons;
+    };
+
+    using LeafAllocator =
+        typename std::allocator_traits<Allocator>::template rebind_alloc<Leaf>;
+    using InnerAllocator =
+        typename std::allocator_traits<Allocator>::template rebind_alloc<Inner>;
+    using LeafTraits = std::allocator_traits<LeafAllocator>;
+    using InnerTraits = std::allocator_traits<InnerAllocator>;
+
+    // Parent of a node locked for reading, with position of the node.
+    struct Parent {
+        Inner* node = nullptr;
+        uint64_t version = 0;
+        size_t pos = 0;
+    };
+
+  public:
+    explicit ConcurrentSet(const Compare& comp = Compare(),
+                           const Allocator& alloc = Allocator());
+
+    explicit ConcurrentSet(const Allocator& alloc);
+
+    ConcurrentSet(const ConcurrentSet<T, Compare, Allocator>&) = delete;
+
+    ~ConcurrentSet();
+
+    ConcurrentSet<T, Compare, Allocator>& operator=(
+        const ConcurrentSet<T, Compare, Allocator>&) = delete;
+
+    // Returns number of elements. Concurrent changes may be counted or not.
+    // Time: O(n).
+    size_t size() const;
+
+    // Checks whether the container is empty. Time: O(n).
+    bool empty() const { return size() == 0; }
+
+    Compare key_comp() const { return this->comp(); }
+
+    // Inserts element into the set, if the set doesn't already contain an
+    // element with an equivalent key. Returns whether insertion took place.
+    // Time: O(log(n)).
+    bool insert(const T& elem);
+
+    // Removes elem from the set, if the set contain it. Returns whether
+    // removal took place. Time: O(log(n)).
+    bool erase(const T& elem);
+
+    // Checks whether the set contains the given key. Never blocks writers.
+    // Time: O(log(n)).
+    bool contains(const T& elem) const;
+
+    // Returns the first element not less than the given key, if any. Never
+    // blocks writers. Time: O(log(n)) plus number of empty leaves skipped.
+    std::optional<T> lower_bound(const T& elem) const;
+
+  private:
+    // Compares keys with the set's comparator.
+    inline bool less_(const T& a, const T& b) const {
+        return this->comp()(a, b);
+    }
+
+    // Allocates empty leaf. Time: O(1).
+    Leaf* new_leaf_();
+
+    // Allocates internal node without sons. Time: O(1).
+    Inner* new_inner_();
+
+    // Frees node, but not its sons. Time: O(1).
+    void delete_node_(Node* node);
+
+    // Frees node with its subtree. Time: O(size of subtree).
+    void destruct_(Node* node);
+
+    // Frees leaf retired by set. Time: O(1).
+    static void reclaim_leaf_(void* set, void* leaf);
+
+    // Returns number of keys of node, which may be read during a change.
+    // Time: O(1).
+    static size_t count_(const Node* node);
+
+    // Returns index of the first key of node not less than the given key, or
+    // number of keys. Time: O(NODE_SIZE).
+    template<class N>
+    size_t lower_key_(const N* node, size_t count, const T& key) const;
+
+    // Locks root and its version for reading. Returns nullptr if the root
+    // changed meanwhile. Time: O(1).
+    Node* lock_root_(uint64_t& version) const;
+
+    // Descends to the leaf for key and returns it, locked for reading with
+    // version, or nullptr if a concurrent change was seen. Sets parent of the
+    // leaf, if any. Time: O(log(n)).
+    Leaf* find_leaf_(const T& key, uint64_t& version, Parent& parent) const;
+
+    // Single attempts of the operations. Return false if a concurrent change
+    // was seen, so the attempt must be repeated. Time: O(log(n)).
+    bool try_insert_(const T& elem, bool& inserted);
+
+    bool try_erase_(const T& elem, bool& erased, EpochDomain::Guard& guard);
+
+    bool try_contains_(const T& elem, bool& found) const;
+
+    bool try_lower_bound_(const T& elem, std::optional<T>& res) const;
+
+    // Moves upper half of full node to right, an empty node of the same
+    // kind, and returns the key separating them. Time: O(NODE_SIZE).
+    T split_(Node* node, Node* right);
+
+    // Unlinks leaf with a single key from parent and the leaf list, then
+    // retires it. Returns false if a concurrent change was seen.
+    // Time: O(NODE_SIZE).
+    bool try_unlink_(Leaf* leaf, uint64_t version, const Parent& parent,
+                     EpochDomain::Guard& guard);
+
+  private:
+    Allocator alloc_;
+    LeafAllocator leaf_alloc_{alloc_};
+    InnerAllocator inner_alloc_{alloc_};
+    std::atomic<Node*> root_{nullptr};
+    // Destroyed before the allocators, which free leaves retired to it.
+    mutable EpochDomain epoch_;
+};
+
+template<class T, class Compare, class Allocator>
+uint64_t ConcurrentSet<T, Compare, Allocator>::Node::read_lock() const {
+    uint64_t cur = version.load(std::memory_order_acquire);
+    for (size_t spins = 0; (cur & 1) && cur != OBSOLETE; ++spins) {
+        if (spins >= 64) {
+            std::this_thread::yield();
+        }
+        cur = version.load(std::memory_order_acquire);
+    }
+    return cur;
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSet<T, Compare, Allocator>::Node::validate(
+    uint64_t expected) const {
+    // Keeps the relaxed reads of node before the check.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return version.load(std::memory_order_relaxed) == expected;
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSet<T, Compare, Allocator>::Node::upgrade(uint64_t expected) {
+    if (expected == OBSOLETE ||
+        !version.compare_exchange_strong(expected, expected + 1,
+                                         std::memory_order_acquire)) {
+        return false;
+    }
+    // Readers that see any of the following writes see the lock as well.
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentSet<T, Compare, Allocator>::Node::unlock() {
+    version.fetch_add(1, std::memory_order_release);
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentSet<T, Compare, Allocator>::Node::unlock_obsolete() {
+    version.store(OBSOLETE, std::memory_order_release);
+}
+
+template<class T, class Compare, class Allocator>
+ConcurrentSet<T, Compare, Allocator>::ConcurrentSet(const Compare& comp,
+                                                    const Allocator& alloc)
+    : CompareHolder<Compare>(comp), alloc_(alloc) {
+    root_.store(new_leaf_(), std::memory_order_relaxed);
+}
+
+template<class T, class Compare, class Allocator>
+ConcurrentSet<T, Compare, Allocator>::ConcurrentSet(const Allocator& alloc)
+    : ConcurrentSet(Compare(), alloc) {}
+
+template<class T, class Compare, class Allocator>
+ConcurrentSet<T, Compare, Allocator>::~ConcurrentSet() {
+    destruct_(root_.load(std::memory_order_relaxed));
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentSet<T, Compare, Allocator>::Leaf*
+ConcurrentSet<T, Compare, Allocator>::new_leaf_() {
+    Leaf* node = LeafTraits::allocate(leaf_alloc_, 1);
+    LeafTraits::construct(leaf_alloc_, node);
+    return node;
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentSet<T, Compare, Allocator>::Inner*
+ConcurrentSet<T, Compare, Allocator>::new_inner_() {
+    Inner* node = InnerTraits::allocate(inner_alloc_, 1);
+    InnerTraits::construct(inner_alloc_, node);
+    return node;
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentSet<T, Compare, Allocator>::delete_node_(Node* node) {
+    if (node->leaf) {
+        Leaf* leaf = static_cast<Leaf*>(node);
+        LeafTraits::destroy(leaf_alloc_, leaf);
+        LeafTraits::deallocate(leaf_alloc_, leaf, 1);
+    } else {
+        Inner* inner = static_cast<Inner*>(node);
+        InnerTraits::destroy(inner_alloc_, inner);
+        InnerTraits::deallocate(inner_alloc_, inner, 1);
+    }
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentSet<T, Compare, Allocator>::destruct_(Node* node) {
+    if (!node->leaf) {
+        Inner* inner = static_cast<Inner*>(node);
+        size_t count = count_(inner);
+        for (size_t i = 0; i <= count; ++i) {
+            destruct_(inner->sons[i].load(std::memory_order_relaxed));
+        }
+    }
+    delete_node_(node);
+}
+
+template<class T, class Compare, class Allocator>
+void ConcurrentSet<T, Compare, Allocator>::reclaim_leaf_(void* set,
+                                                         void* leaf) {
+    static_cast<ConcurrentSet<T, Compare, Allocator>*>(set)->delete_node_(
+        static_cast<Leaf*>(leaf));
+}
+
+template<class T, class Compare, class Allocator>
+size_t ConcurrentSet<T, Compare, Allocator>::count_(const Node* node) {
+    return std::min(node->count.load(std::memory_order_relaxed), NODE_SIZE);
+}
+
+template<class T, class Compare, class Allocator>
+template<class N>
+size_t ConcurrentSet<T, Compare, Allocator>::lower_key_(const N* node,
+                                                        size_t count,
+                                                        const T& key) const {
+    size_t i = 0;
+    while (i < count &&
+           less_(node->keys[i].load(std::memory_order_relaxed), key)) {
+        ++i;
+    }
+    return i;
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentSet<T, Compare, Allocator>::Node*
+ConcurrentSet<T, Compare, Allocator>::lock_root_(uint64_t& version) const {
+    Node* node = root_.load(std::memory_order_acquire);
+    version = node->read_lock();
+    // A root split after the load leaves node with the lower half only.
+    if (node != root_.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+    return node;
+}
+
+template<class T, class Compare, class Allocator>
+typename ConcurrentSet<T, Compare, Allocator>::Leaf*
+ConcurrentSet<T, Compare, Allocator>::find_leaf_(const T& key,
+                                                 uint64_t& version,
+                                                 Parent& parent) const {
+    Node* node = lock_root_(version);
+    if (node == nullptr) {
+        return nullptr;
+    }
+    while (!node->leaf) {
+        const Inner* inner = static_cast<const Inner*>(node);
+        size_t i = lower_key_(inner, count_(inner), key);
+        Node* son = inner->sons[i].load(std::memory_order_relaxed);
+        if (!inner->validate(version)) {
+            return nullptr;
+        }
+        uint64_t son_version = son->read_lock();
+        if (!inner->validate(version)) {
+            return nullptr;
+        }
+        parent.node = const_cast<Inner*>(inner);
+        parent.version = version;
+        parent.pos = i;
+        node = son;
+        version = son_version;
+    }
+    return static_cast<Leaf*>(node);
+}
+
+template<class T, class Compare, class Allocator>
+size_t ConcurrentSet<T, Compare, Allocator>::size() const {
+    EpochDomain::Guard guard = epoch_.pin();
+    const Node* node = root_.load(std::memory_order_acquire);
+    while (!node->leaf) {
+        node = static_cast<const Inner*>(node)->sons[0].load(
+            std::memory_order_acquire);
+    }
+    size_t size = 0;
+    for (const Leaf* leaf = static_cast<const Leaf*>(node); leaf != nullptr;
+         leaf = leaf->next.load(std::memory_order_acquire)) {
+        size += count_(leaf);
+    }
+    return size;
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSet<T, Compare, Allocator>::insert(const T& elem) {
+    EpochDomain::Guard guard = epoch_.pin();
+    bool inserted = false;
+    while (!try_insert_(elem, inserted)) {
+    }
+    return inserted;
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSet<T, Compare, Allocator>::erase(const T& elem) {
+    EpochDomain::Guard guard = epoch_.pin();
+    bool erased = false;
+    while (!try_erase_(elem, erased, guard)) {
+    }
+    return erased;
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSet<T, Compare, Allocator>::contains(const T& elem) const {
+    EpochDomain::Guard guard = epoch_.pin();
+    bool found = false;
+    while (!try_contains_(elem, found)) {
+    }
+    return found;
+}
+
+template<class T, class Compare, class Allocator>
+std::optional<T>
+ConcurrentSet<T, Compare, Allocator>::lower_bound(const T& elem) const {
+    EpochDomain::Guard guard = epoch_.pin();
+    std::optional<T> res;
+    while (!try_lower_bound_(elem, res)) {
+    }
+    return res;
+}
+
+template<class T, class Compare, class Allocator>
+T ConcurrentSet<T, Compare, Allocator>::split_(Node* node, Node* right) {
+    size_t count = count_(node);
+    size_t half = count / 2;
+    if (node->leaf) {
+        // Leaf keeps the lower half, whose max separates the leaves.
+        Leaf* leaf = static_cast<Leaf*>(node);
+        Leaf* other = static_cast<Leaf*>(right);
+        for (size_t i = half; i < count; ++i) {
+            other->keys[i - half].store(
+                leaf->keys[i].load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+        }
+        other->count.store(count - half, std::memory_order_relaxed);
+        other->next.store(leaf->next.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+        leaf->next.store(other, std::memory_order_release);
+        leaf->count.store(half, std::memory_order_relaxed);
+        return leaf->keys[half - 1].load(std::memory_order_relaxed);
+    }
+    // The middle key moves up.
+    Inner* inner = static_cast<Inner*>(node);
+    Inner* other = static_cast<Inner*>(right);
+    for (size_t i = half + 1; i < count; ++i) {
+        other->keys[i - half - 1].store(
+            inner->keys[i].load(std::memory_order_relaxed),
+            std::memory_order_relaxed);
+    }
+    for (size_t i = half + 1; i <= count; ++i) {
+        other->sons[i - half - 1].store(
+            inner->sons[i].load(std::memory_order_relaxed),
+            std::memory_order_relaxed);
+    }
+    other->count.store(count - half - 1, std::memory_order_relaxed);
+    inner->count.store(half, std::memory_order_relaxed);
+    return inner->keys[half].load(std::memory_order_relaxed);
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSet<T, Compare, Allocator>::try_insert_(const T& elem,
+                                                       bool& inserted) {
+    uint64_t version;
+    Node* node = lock_root_(version);
+    if (node == nullptr) {
+        return false;
+    }
+    Inner* parent = nullptr;
+    uint64_t parent_version = 0;
+    size_t pos = 0;
+    for (;;) {
+        if (count_(node) == NODE_SIZE) {
+            // New nodes are allocated before locking, so nothing throws while
+            // locks are held. Unused ones were never seen by others.
+            Node* right = nullptr;
+            Inner* root = nullptr;
+            try {
+                right = (node->leaf ? static_cast<Node*>(new_leaf_())
+                                    : static_cast<Node*>(new_inner_()));
+                if (parent == nullptr) {
+                    root = new_inner_();
+                }
+            } catch (...) {
+                if (right != nullptr) {
+                    delete_node_(right);
+                }
+                throw;
+            }
+            bool locked =
+                (parent == nullptr || parent->upgrade(parent_version));
+            if (locked && !node->upgrade(version)) {
+                if (parent != nullptr) {
+                    parent->unlock();
+                }
+                locked = false;
+            }
+            if (locked && parent == nullptr &&
+                node != root_.load(std::memory_order_relaxed)) {
+                node->unlock();
+                locked = false;
+            }
+            if (!locked) {
+                delete_node_(right);
+                if (root != nullptr) {
+                    delete_node_(root);
+                }
+                return false;
+            }
+            T separator = split_(node, right);
+            if (parent == nullptr) {
+                root->keys[0].store(separator, std::memory_order_relaxed);
+                root->sons[0].store(node, std::memory_order_relaxed);
+                root->sons[1].store(right, std::memory_order_relaxed);
+                root->count.store(1, std::memory_order_relaxed);
+                root_.store(root, std::memory_order_release);
+            } else {
+                size_t count = count_(parent);
+                for (size_t i = count; i > pos; --i) {
+                    parent->keys[i].store(
+                        parent->keys[i - 1].load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+                    parent->sons[i + 1].store(
+                        parent->sons[i].load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+                }
+                parent->keys[pos].store(separator, std::memory_order_relaxed);
+                parent->sons[pos + 1].store(right, std::memory_order_relaxed);
+                parent->count.store(count + 1, std::memory_order_relaxed);
+                parent->unlock();
+            }
+            node->unlock();
+            return false;
+        }
+        if (parent != nullptr && !parent->validate(parent_version)) {
+            return false;
+        }
+        if (node->leaf) {
+            break;
+        }
+        Inner* inner = static_cast<Inner*>(node);
+        size_t i = lower_key_(inner, count_(inner), elem);
+        Node* son = inner->sons[i].load(std::memory_order_relaxed);
+        if (!inner->validate(version)) {
+            return false;
+        }
+        parent = inner;
+        parent_version = version;
+        pos = i;
+        node = son;
+        version = son->read_lock();
+        if (!parent->validate(parent_version)) {
+            return false;
+        }
+    }
+
+    Leaf* leaf = static_cast<Leaf*>(node);
+    if (!leaf->upgrade(version)) {
+        return false;
+    }
+    size_t count = count_(leaf);
+    size_t i = lower_key_(leaf, count, elem);
+    if (i < count &&
+        !less_(elem, leaf->keys[i].load(std::memory_order_relaxed))) {
+        leaf->unlock();
+        inserted = false;
+        return true;
+    }
+    for (size_t j = count; j > i; --j) {
+        leaf->keys[j].store(leaf->keys[j - 1].load(std::memory_order_relaxed),
+                            std::memory_order_relaxed);
+    }
+    leaf->keys[i].store(elem, std::memory_order_relaxed);
+    leaf->count.store(count + 1, std::memory_order_relaxed);
+    leaf->unlock();
+    inserted = true;
+    return true;
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSet<T, Compare, Allocator>::try_erase_(
+    const T& elem, bool& erased, EpochDomain::Guard& guard) {
+    uint64_t version;
+    Parent parent;
+    Leaf* leaf = find_leaf_(elem, version, parent);
+    if (leaf == nullptr) {
+        return false;
+    }
+    size_t count = count_(leaf);
+    size_t i = lower_key_(leaf, count, elem);
+    erased = (i < count &&
+              !less_(elem, leaf->keys[i].load(std::memory_order_relaxed)));
+    if (!erased) {
+        return leaf->validate(version);
+    }
+    // The first son has no brother to take over its range.
+    if (count == 1 && parent.node != nullptr && parent.pos > 0) {
+        return try_unlink_(leaf, version, parent, guard);
+    }
+    if (!leaf->upgrade(version)) {
+        return false;
+    }
+    for (size_t j = i + 1; j < count; ++j) {
+        leaf->keys[j - 1].store(leaf->keys[j].load(std::memory_order_relaxed),
+                                std::memory_order_relaxed);
+    }
+    leaf->count.store(count - 1, std::memory_order_relaxed);
+    leaf->unlock();
+    return true;
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSet<T, Compare, Allocator>::try_unlink_(
+    Leaf* leaf, uint64_t version, const Parent& parent,
+    EpochDomain::Guard& guard) {
+    Inner* inner = parent.node;
+    if (!inner->upgrade(parent.version)) {
+        return false;
+    }
+    // Sons of a node are neighbours in the leaf list.
+    Leaf* prev = static_cast<Leaf*>(
+        inner->sons[parent.pos - 1].load(std::memory_order_relaxed));
+    if (!prev->upgrade(prev->read_lock())) {
+        inner->unlock();
+        return false;
+    }
+    if (!leaf->upgrade(version)) {
+        prev->unlock();
+        inner->unlock();
+        return false;
+    }
+    prev->next.store(leaf->next.load(std::memory_order_relaxed),
+                     std::memory_order_release);
+    // The previous son takes over the range of leaf.
+    size_t count = count_(inner);
+    for (size_t j = parent.pos; j < count; ++j) {
+        inner->keys[j - 1].store(inner->keys[j].load(std::memory_order_relaxed),
+                                 std::memory_order_relaxed);
+        inner->sons[j].store(inner->sons[j + 1].load(std::memory_order_relaxed),
+                             std::memory_order_relaxed);
+    }
+    inner->count.store(count - 1, std::memory_order_relaxed);
+    leaf->unlock_obsolete();
+    prev->unlock();
+    inner->unlock();
+    guard.retire(leaf, reclaim_leaf_, this);
+    return true;
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSet<T, Compare, Allocator>::try_contains_(const T& elem,
+                                                         bool& found) const {
+    uint64_t version;
+    Parent parent;
+    const Leaf* leaf = find_leaf_(elem, version, parent);
+    if (leaf == nullptr) {
+        return false;
+    }
+    size_t count = count_(leaf);
+    size_t i = lower_key_(leaf, count, elem);
+    found = (i < count &&
+             !less_(elem, leaf->keys[i].load(std::memory_order_relaxed)));
+    return leaf->validate(version);
+}
+
+template<class T, class Compare, class Allocator>
+bool ConcurrentSet<T, Compare, Allocator>::try_lower_bound_(
+    const T& elem, std::optional<T>& res) const {
+    uint64_t version;
+    Parent parent;
+    const Leaf* leaf = find_leaf_(elem, version, parent);
+    if (leaf == nullptr) {
+        return false;
+    }
+    size_t count = count_(leaf);
+    size_t i = lower_key_(leaf, count, elem);
+    // Keys of the next leaves are greater, so the first one is the answer.
+    // The next leaf is locked before the current one is checked, so no key
+    // can slip between them.
+    while (i == count) {
+        const Leaf* next = leaf->next.load(std::memory_order_acquire);
+        if (next == nullptr) {
+            res.reset();
+            return leaf->validate(version);
+        }
+        uint64_t next_version = next->read_lock();
+        if (!leaf->validate(version)) {
+            return false;
+        }
+        leaf = next;
+        version = next_version;
+        count = count_(leaf);
+        i = 0;
+    }
+    res = leaf->keys[i].load(std::memory_order_relaxed);
+    return leaf->validate(version);
+}
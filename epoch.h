@@ -0,0 +1,325 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ *  Epoch based reclamation of memory shared by many threads. Readers pin the
+ *  domain for the time they hold pointers into a shared structure, writers
+ *  retire objects they have unlinked, and an object is freed only when every
+ *  thread pinned at the time of retirement has unpinned.
+ *
+ *  The global epoch moves forward when all pinned threads have seen its
+ *  current value, and objects retired in epoch e are freed once it reaches
+ *  e + 2. Retired objects are kept in per-record batches, and the epoch is
+ *  moved only when a batch is full, so retire is O(1) amortized. A thread
+ *  moving the epoch frees the batches of all records, and a thread frees its
+ *  own batch when it unpins after the epoch has moved on, so batches of idle
+ *  threads don't wait for their next retire. At most RETIRE_BATCH objects
+ *  per record stay after writers stop, until collect or the destructor.
+ *
+ *  Every thread has one record per domain it pinned, kept in a thread local
+ *  cache, so pin and unpin only store to that record. Records of exited
+ *  threads are reused by new ones and freed with the domain, so their number
+ *  is the peak number of threads using the domain at once.
+ *
+ */
+
+class EpochDomain {
+  private:
+    // Frees ptr, ctx is the context given to retire.
+    using Reclaim = void (*)(void* ctx, void* ptr);
+
+    struct Retired {
+        void* ptr;
+        Reclaim reclaim;
+        void* ctx;
+        uint64_t epoch;
+    };
+
+    // Records are written by their threads on every pin, so each gets its
+    // own cache line.
+    struct alignas(64) Record {
+        explicit Record(EpochDomain* d) : domain(d) {}
+
+        // Pinned epoch shifted by one, with the lowest bit set while pinned.
+        std::atomic<uint64_t> local{0};
+        // Epoch at which the oldest retired object can be freed, NONE if
+        // there are no retired objects.
+        std::atomic<uint64_t> free_at{NONE};
+        // Number of guards of the owning thread, which pins only the first.
+        size_t depth = 0;
+        // Owned by a thread.
+        std::atomic<bool> in_use{true};
+        // One reference from the domain and one from the owning thread.
+        std::atomic<int> refs{2};
+        EpochDomain* const domain;
+        Record* next = nullptr;
+        // Objects retired by the owning thread, which the threads moving the
+        // epoch free too.
+        std::mutex mutex;
+        std::vector<Retired> retired;
+    };
+
+    // Records of the current thread, at most one per live domain.
+    struct ThreadRecords {
+        ThreadRecords() = default;
+
+        ThreadRecords(const ThreadRecords&) = delete;
+
+        ThreadRecords& operator=(const ThreadRecords&) = delete;
+
+        // Gives records back to their domains.
+        ~ThreadRecords();
+
+        std::vector<Record*> records;
+    };
+
+    static constexpr uint64_t NONE = std::numeric_limits<uint64_t>::max();
+
+  public:
+    // Number of retired objects, which makes a record try to free them.
+    static constexpr size_t RETIRE_BATCH = 64;
+
+    /**
+     *  Pin of the domain by the current thread. Pointers read while a guard
+     *  is held stay valid until it's destroyed. Guards are destroyed by the
+     *  thread that made them, and a thread may hold several at once.
+     *
+     */
+
+    class Guard {
+      public:
+        Guard(Guard&& other) noexcept
+            : domain_(std::exchange(other.domain_, nullptr)),
+              rec_(std::exchange(other.rec_, nullptr)) {}
+
+        Guard(const Guard&) = delete;
+
+        Guard& operator=(const Guard&) = delete;
+
+        Guard& operator=(Guard&&) = delete;
+
+        ~Guard();
+
+        // Hands an unlinked object over to the domain, reclaim(ctx, ptr)
+        // frees it when no reader can see it. Time: O(1) amortized.
+        void retire(void* ptr, Reclaim reclaim, void* ctx);
+
+      private:
+        friend class EpochDomain;
+
+        Guard(EpochDomain* domain, Record* rec) : domain_(domain), rec_(rec) {}
+
+        EpochDomain* domain_;
+        Record* rec_;
+    };
+
+    EpochDomain() = default;
+
+    EpochDomain(const EpochDomain&) = delete;
+
+    EpochDomain& operator=(const EpochDomain&) = delete;
+
+    // Frees all retired objects. No guard may be held. Time: O(retired).
+    ~EpochDomain();
+
+    // Pins the domain. The first pin of a thread takes a record. Time: O(1),
+    // or O(number of records) the first time.
+    Guard pin();
+
+    // Moves the epoch if it can and frees retired objects that are safe to
+    // free. Time: O(number of records + retired).
+    void collect();
+
+  private:
+    // Returns the record of the current thread, taking a free one or adding
+    // a new one on first use. Time: O(1), or O(number of records) the first
+    // time.
+    Record* thread_record_();
+
+    // Takes a free record or adds a new one. Time: O(number of records).
+    Record* acquire_();
+
+    // Moves the global epoch if all pinned records have seen it, returns
+    // the current epoch. Time: O(number of records).
+    uint64_t try_advance_();
+
+    // Frees objects of all records retired at least two epochs before
+    // epoch. Time: O(number of records + freed objects).
+    void free_all_retired_(uint64_t epoch);
+
+    // Frees objects of rec retired at least two epochs before epoch, with
+    // rec's mutex held. Time: O(freed objects).
+    static void free_retired_(Record* rec, uint64_t epoch);
+
+  private:
+    std::atomic<uint64_t> epoch_{0};
+    std::atomic<Record*> records_{nullptr};
+};
+
+inline EpochDomain::ThreadRecords::~ThreadRecords() {
+    for (Record* rec : records) {
+        rec->in_use.store(false, std::memory_order_release);
+        if (rec->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete rec;
+        }
+    }
+}
+
+inline EpochDomain::Guard::~Guard() {
+    if (rec_ == nullptr || --rec_->depth != 0) {
+        return;
+    }
+    rec_->local.store(0, std::memory_order_release);
+    uint64_t epoch = domain_->epoch_.load(std::memory_order_acquire);
+    if (rec_->free_at.load(std::memory_order_relaxed) <= epoch) {
+        std::lock_guard<std::mutex> lock(rec_->mutex);
+        free_retired_(rec_, epoch);
+    }
+}
+
+inline void EpochDomain::Guard::retire(void* ptr, Reclaim reclaim, void* ctx) {
+    // Readers that can still reach ptr have pinned an epoch not greater.
+    uint64_t epoch = domain_->epoch_.load(std::memory_order_seq_cst);
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(rec_->mutex);
+        if (rec_->retired.empty()) {
+            rec_->free_at.store(epoch + 2, std::memory_order_relaxed);
+        }
+        rec_->retired.push_back({ptr, reclaim, ctx, epoch});
+        full = rec_->retired.size() >= RETIRE_BATCH;
+    }
+    if (full) {
+        domain_->free_all_retired_(domain_->try_advance_());
+    }
+}
+
+inline EpochDomain::~EpochDomain() {
+    Record* rec = records_.load(std::memory_order_acquire);
+    while (rec != nullptr) {
+        {
+            std::lock_guard<std::mutex> lock(rec->mutex);
+            for (const Retired& obj : rec->retired) {
+                obj.reclaim(obj.ctx, obj.ptr);
+            }
+            rec->retired.clear();
+        }
+        // Records still cached by a thread are deleted by it.
+        Record* next = rec->next;
+        if (rec->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete rec;
+        }
+        rec = next;
+    }
+}
+
+inline EpochDomain::Guard EpochDomain::pin() {
+    Record* rec = thread_record_();
+    if (rec->depth++ == 0) {
+        uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+        rec->local.store((epoch << 1) | 1, std::memory_order_relaxed);
+        // The pin is seen before any pointer read under it.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    return Guard(this, rec);
+}
+
+inline void EpochDomain::collect() {
+    free_all_retired_(try_advance_());
+}
+
+inline EpochDomain::Record* EpochDomain::thread_record_() {
+    thread_local ThreadRecords cache;
+    std::vector<Record*>& records = cache.records;
+    for (Record* rec : records) {
+        // A record of a destroyed domain at this address has lost the
+        // domain's reference.
+        if (rec->domain == this &&
+            rec->refs.load(std::memory_order_acquire) == 2) {
+            return rec;
+        }
+    }
+    // Records of destroyed domains are never used again.
+    size_t kept = 0;
+    for (Record* rec : records) {
+        if (rec->refs.load(std::memory_order_acquire) == 1) {
+            delete rec;
+        } else {
+            records[kept++] = rec;
+        }
+    }
+    records.resize(kept);
+    Record* rec = acquire_();
+    records.push_back(rec);
+    return rec;
+}
+
+inline EpochDomain::Record* EpochDomain::acquire_() {
+    Record* head = records_.load(std::memory_order_acquire);
+    for (Record* rec = head; rec != nullptr; rec = rec->next) {
+        bool expected = false;
+        if (!rec->in_use.load(std::memory_order_relaxed) &&
+            rec->in_use.compare_exchange_strong(expected, true,
+                                                std::memory_order_acquire)) {
+            rec->refs.fetch_add(1, std::memory_order_relaxed);
+            return rec;
+        }
+    }
+    Record* rec = new Record(this);
+    rec->next = head;
+    while (!records_.compare_exchange_weak(rec->next, rec,
+                                           std::memory_order_acq_rel)) {
+    }
+    return rec;
+}
+
+inline uint64_t EpochDomain::try_advance_() {
+    uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+    // Pins made before the check are seen by it.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (Record* rec = records_.load(std::memory_order_acquire);
+         rec != nullptr; rec = rec->next) {
+        uint64_t local = rec->local.load(std::memory_order_relaxed);
+        if ((local & 1) && (local >> 1) != epoch) {
+            return epoch;
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (epoch_.compare_exchange_strong(epoch, epoch + 1,
+                                       std::memory_order_acq_rel)) {
+        return epoch + 1;
+    }
+    return epoch;
+}
+
+inline void EpochDomain::free_all_retired_(uint64_t epoch) {
+    for (Record* rec = records_.load(std::memory_order_acquire);
+         rec != nullptr; rec = rec->next) {
+        if (rec->free_at.load(std::memory_order_relaxed) <= epoch) {
+            std::lock_guard<std::mutex> lock(rec->mutex);
+            free_retired_(rec, epoch);
+        }
+    }
+}
+
+inline void EpochDomain::free_retired_(Record* rec, uint64_t epoch) {
+    size_t freed = 0;
+    while (freed < rec->retired.size() &&
+           rec->retired[freed].epoch + 2 <= epoch) {
+        rec->retired[freed].reclaim(rec->retired[freed].ctx,
+                                    rec->retired[freed].ptr);
+        ++freed;
+    }
+    rec->retired.erase(rec->retired.begin(),
+                       rec->retired.begin() + freed);
+    rec->free_at.store(
+        rec->retired.empty() ? NONE : rec->retired.front().epoch + 2,
+        std::memory_order_relaxed);
+}
@@ -0,0 +1,793 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "tree.h"
+
+/**
+ *  Header of a file with FrozenSet keys, which is followed by the keys in
+ *  the order of the set's array starting at offset, so the file is used
+ *  as it is once mapped. Magic is written last, so an interrupted write
+ *  leaves a file that doesn't load.
+ *
+ */
+
+struct FrozenSetHeader {
+    static constexpr char MAGIC[8] = "FROZSET";
+    static constexpr uint32_t VERSION = 1;
+    // Stored as written, so files of other byte order don't match.
+    static constexpr uint32_t ENDIAN_MARK = 0x01020304;
+    // Offset of keys, which bounds their alignment.
+    static constexpr size_t OFFSET = 64;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t key_size;
+    uint64_t key_align;
+    uint64_t size;
+    uint64_t offset;
+};
+
+/**
+ *  Writes keys given in ascending order to a file that FrozenSet loads
+ *  with load_mmap. The file is mapped and keys go straight to their places
+ *  in it, so neither the keys nor the set are kept in memory. Needs POSIX.
+ *
+ *  @tparam T  Trivially copyable type of key objects.
+ *
+ */
+
+template<class T>
+class FrozenSetWriter {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "keys must be trivially copyable");
+    static_assert(alignof(T) <= FrozenSetHeader::OFFSET,
+                  "keys are overaligned");
+
+  public:
+    // Creates file at path for count keys, replacing an existing one.
+    // Throws std::system_error if it can't be created.
+    FrozenSetWriter(const std::string& path, size_t count);
+
+    FrozenSetWriter(const FrozenSetWriter&) = delete;
+
+    FrozenSetWriter& operator=(const FrozenSetWriter&) = delete;
+
+    // Unmaps the file, which doesn't load unless finish was called.
+    ~FrozenSetWriter();
+
+    // Writes the next key, which must be greater than the previous ones.
+    // Throws std::length_error after count keys. Time: O(1) amortized.
+    void push(const T& key);
+
+    // Completes the file and flushes it to disk. Throws std::length_error
+    // if less than count keys were pushed, std::system_error if flushing
+    // fails.
+    void finish();
+
+  private:
+    template<class, class, class>
+    friend class FrozenSet;
+
+    // Returns the array of keys in the mapping.
+    T* keys_() const {
+        return reinterpret_cast<T*>(base_ + FrozenSetHeader::OFFSET);
+    }
+
+    // Unmaps the file. Time: O(1).
+    void unmap_();
+
+    // Throws std::system_error with errno unless ok.
+    static void check_(bool ok, const char* what);
+
+  private:
+    char* base_ = nullptr;
+    size_t length_ = 0;
+    size_t count_ = 0;
+    size_t pushed_ = 0;
+    // Position of the next key in the set's array, counting from 1.
+    size_t pos_ = 0;
+};
+
+/**
+ *  An immutable sorted set for read-only phases between rebuilds. Keys are
+ *  stored in one array in Eytzinger order: the root of an implicit binary
+ *  search tree is at position 1 and sons of position k are at 2k and
+ *  2k + 1. There are no pointers, so the set takes sizeof(T) per key, and
+ *  the first levels of the search are shared by all lookups and stay in
+ *  cache.
+ *
+ *  Search goes down the implicit tree without branching on the result of
+ *  comparisons and prefetches the cache line holding the descendants a few
+ *  levels below, so misses of consecutive levels overlap. Iteration walks
+ *  the implicit tree in order and is slower than over Set's leaf list.
+ *
+ *  The array has no pointers, so sets of trivially copyable keys are saved
+ *  to a file as they are, and load_mmap uses the mapped file as the array
+ *  without parsing or allocation. Copies of a mapped set share the mapping.
+ *
+ *  @tparam T          Type of key objects.
+ *  @tparam Compare    Strict weak ordering of keys. If it has is_transparent,
+ *                     lookups accept any type comparable with keys.
+ *  @tparam Allocator  Allocator of the key array.
+ *
+ */
+
+template<class T, class Compare = std::less<T>,
+         class Allocator = std::allocator<T>>
+class FrozenSet : private CompareHolder<Compare> {
+  private:
+    using KeyTraits = std::allocator_traits<Allocator>;
+
+    // Keys in one cache line, which are descendants of one position a few
+    // levels above them in the implicit tree.
+    static constexpr size_t LINE_KEYS = (sizeof(T) < 64 ? 64 / sizeof(T) : 1);
+
+  public:
+    // Bidirectional iterator holding a position in the implicit tree, 0 is
+    // the end. It stays valid while the set it came from is alive.
+    class Iterator {
+      public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        Iterator() = default;
+
+        // Go to next element. Time: O(1) amortized.
+        Iterator& operator++();
+
+        // Go to next element. Time: O(1) amortized.
+        Iterator operator++(int);
+
+        // Go to previous element. Time: O(1) amortized.
+        Iterator& operator--();
+
+        // Go to previous element. Time: O(1) amortized.
+        Iterator operator--(int);
+
+        const T& operator*() const { return s_->at_(pos_); }
+
+        const T* operator->() const { return &s_->at_(pos_); }
+
+        bool operator==(const Iterator& iter) const {
+            return pos_ == iter.pos_;
+        }
+
+        bool operator!=(const Iterator& iter) const {
+            return pos_ != iter.pos_;
+        }
+
+      private:
+        friend class FrozenSet;
+
+        Iterator(const FrozenSet<T, Compare, Allocator>* s, size_t pos)
+            : s_(s), pos_(pos) {}
+
+        const FrozenSet<T, Compare, Allocator>* s_ = nullptr;
+        size_t pos_ = 0;
+    };
+
+    using iterator = Iterator;
+    using const_iterator = Iterator;
+
+    explicit FrozenSet(const Compare& comp = Compare(),
+                       const Allocator& alloc = Allocator());
+
+    explicit FrozenSet(const Allocator& alloc);
+
+    // Copies keys of s, using its comparator. Time: O(n).
+    template<class SetAllocator, class Policy>
+    explicit FrozenSet(const Set<T, Compare, SetAllocator, Policy>& s,
+                       const Allocator& alloc = Allocator());
+
+    // Builds the set from the range, which is sorted and has no equal keys.
+    // Time: O(n).
+    template<class ForwardIterator>
+    FrozenSet(assume_sorted_t, ForwardIterator first, ForwardIterator last,
+              const Compare& comp = Compare(),
+              const Allocator& alloc = Allocator());
+
+    // Builds the set from the range, keeping the first of equal keys.
+    // Time: O(n * log(n)).
+    template<class InputIterator>
+    FrozenSet(InputIterator first, InputIterator last,
+              const Compare& comp = Compare(),
+              const Allocator& alloc = Allocator());
+
+    FrozenSet(std::initializer_list<T> elems, const Compare& comp = Compare(),
+              const Allocator& alloc = Allocator());
+
+    // Returns set that reads keys from the file at path written by save or
+    // FrozenSetWriter, which must not change while the set or its copies
+    // are alive. Throws std::system_error if the file can't be mapped and
+    // std::runtime_error if it's not a complete file of keys of type T.
+    // Time: O(1).
+    static FrozenSet<T, Compare, Allocator> load_mmap(
+        const std::string& path, const Compare& comp = Compare());
+
+    // Time: O(n), or O(1) if s is mapped.
+    FrozenSet(const FrozenSet<T, Compare, Allocator>& s);
+
+    FrozenSet(FrozenSet<T, Compare, Allocator>&& s) noexcept;
+
+    ~FrozenSet();
+
+    // Time: O(n).
+    FrozenSet<T, Compare, Allocator>& operator=(
+        const FrozenSet<T, Compare, Allocator>& s);
+
+    FrozenSet<T, Compare, Allocator>& operator=(
+        FrozenSet<T, Compare, Allocator>&& s) noexcept;
+
+    // Return number of elements. Time: O(1).
+    inline size_t size() const { return size_; }
+
+    // Checks whether the container is empty. Time: O(1).
+    inline bool empty() const { return size_ == 0; }
+
+    inline Allocator get_allocator() const { return alloc_; }
+
+    inline Compare key_comp() const { return this->comp(); }
+
+    // Writes keys to the file at path, which load_mmap maps. Throws
+    // std::system_error if the file can't be written. Time: O(n).
+    void save(const std::string& path) const;
+
+    // Returns an iterator to the beginning. Time: O(log(n)).
+    Iterator begin() const;
+
+    // Returns an iterator to the end. Time: O(1).
+    Iterator end() const;
+
+    // Returns an iterator to the first element not less than the given key.
+    // Time: O(log(n)).
+    Iterator lower_bound(const T& elem) const;
+
+    template<class K, class C = Compare, class = typename C::is_transparent>
+    Iterator lower_bound(const K& key) const;
+
+    // Returns an iterator to the first element greater than the given key.
+    // Time: O(log(n)).
+    Iterator upper_bound(const T& elem) const;
+
+    template<class K, class C = Compare, class = typename C::is_transparent>
+    Iterator upper_bound(const K& key) const;
+
+    // Returns an iterator to the element equal to the given key.
+    // Time: O(log(n)).
+    Iterator find(const T& elem) const;
+
+    template<class K, class C = Compare, class = typename C::is_transparent>
+    Iterator find(const K& key) const;
+
+    // Checks whether the set contains the given key. Time: O(log(n)).
+    bool contains(const T& elem) const;
+
+    template<class K, class C = Compare, class = typename C::is_transparent>
+    bool contains(const K& key) const;
+
+  private:
+    template<class>
+    friend class FrozenSetWriter;
+
+    // Compares keys with the set's comparator.
+    template<class A, class B>
+    inline bool less_(const A& a, const B& b) const {
+        return this->comp()(a, b);
+    }
+
+    // Returns key at position pos of the implicit tree. Time: O(1).
+    const T& at_(size_t pos) const { return data_[pos - 1]; }
+
+    // Returns the first position of the implicit tree with n keys in
+    // order, or 0 if it's empty. Time: O(log(n)).
+    static size_t first_(size_t n);
+
+    // Returns the last position in order. Time: O(log(n)).
+    static size_t last_(size_t n);
+
+    // Returns the position after pos in order, or 0. Time: O(1) amortized.
+    static size_t next_(size_t pos, size_t n);
+
+    // Returns the position before pos in order, or 0. Time: O(1) amortized.
+    static size_t prev_(size_t pos, size_t n);
+
+    // Returns position of the first key for which pred is false, or 0 if
+    // there is none. Keys for which pred is true must go first.
+    // Time: O(log(n)).
+    template<class Pred>
+    size_t search_(Pred pred) const;
+
+    // Allocates the array for count keys and copies them from the sorted
+    // range. Time: O(n).
+    template<class ForwardIterator>
+    void build_(ForwardIterator first, size_t count);
+
+    // Destroys the first count keys in order and frees the array, or
+    // drops the mapping. Time: O(n).
+    void destruct_(size_t count);
+
+  private:
+    Allocator alloc_;
+    T* data_ = nullptr;
+    size_t size_ = 0;
+    // Owner of the mapped file holding data_, if any.
+    std::shared_ptr<const void> mapping_;
+};
+
+template<class T>
+FrozenSetWriter<T>::FrozenSetWriter(const std::string& path, size_t count)
+    : count_(count) {
+    length_ = FrozenSetHeader::OFFSET + count * sizeof(T);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    check_(fd >= 0, "open");
+    if (::ftruncate(fd, static_cast<off_t>(length_)) != 0) {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::generic_category(), "ftruncate");
+    }
+    void* base =
+        ::mmap(nullptr, length_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        throw std::system_error(err, std::generic_category(), "mmap");
+    }
+    base_ = static_cast<char*>(base);
+    pos_ = FrozenSet<T>::first_(count_);
+}
+
+template<class T>
+FrozenSetWriter<T>::~FrozenSetWriter() {
+    unmap_();
+}
+
+template<class T>
+void FrozenSetWriter<T>::push(const T& key) {
+    if (pushed_ == count_) {
+        throw std::length_error("too many keys");
+    }
+    std::memcpy(keys_() + pos_ - 1, &key, sizeof(T));
+    pos_ = FrozenSet<T>::next_(pos_, count_);
+    ++pushed_;
+}
+
+template<class T>
+void FrozenSetWriter<T>::finish() {
+    if (pushed_ != count_) {
+        throw std::length_error("too few keys");
+    }
+    FrozenSetHeader header;
+    header.version = FrozenSetHeader::VERSION;
+    header.byte_order = FrozenSetHeader::ENDIAN_MARK;
+    header.key_size = sizeof(T);
+    header.key_align = alignof(T);
+    header.size = count_;
+    header.offset = FrozenSetHeader::OFFSET;
+    std::memcpy(header.magic, FrozenSetHeader::MAGIC, sizeof(header.magic));
+    std::memcpy(base_, &header, sizeof(header));
+    check_(::msync(base_, length_, MS_SYNC) == 0, "msync");
+    unmap_();
+}
+
+template<class T>
+void FrozenSetWriter<T>::unmap_() {
+    if (base_ != nullptr) {
+        ::munmap(base_, length_);
+        base_ = nullptr;
+    }
+}
+
+template<class T>
+void FrozenSetWriter<T>::check_(bool ok, const char* what) {
+    if (!ok) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+}
+
+template<class T, class Compare, class Allocator>
+FrozenSet<T, Compare, Allocator>::FrozenSet(const Compare& comp,
+                                            const Allocator& alloc)
+    : CompareHolder<Compare>(comp), alloc_(alloc) {}
+
+template<class T, class Compare, class Allocator>
+FrozenSet<T, Compare, Allocator>::FrozenSet(const Allocator& alloc)
+    : alloc_(alloc) {}
+
+template<class T, class Compare, class Allocator>
+template<class SetAllocator, class Policy>
+FrozenSet<T, Compare, Allocator>::FrozenSet(
+    const Set<T, Compare, SetAllocator, Policy>& s, const Allocator& alloc)
+    : FrozenSet(s.key_comp(), alloc) {
+    build_(s.begin(), s.size());
+}
+
+template<class T, class Compare, class Allocator>
+template<class ForwardIterator>
+FrozenSet<T, Compare, Allocator>::FrozenSet(assume_sorted_t,
+                                            ForwardIterator first,
+                                            ForwardIterator last,
+                                            const Compare& comp,
+                                            const Allocator& alloc)
+    : FrozenSet(comp, alloc) {
+    build_(first, static_cast<size_t>(std::distance(first, last)));
+}
+
+template<class T, class Compare, class Allocator>
+template<class InputIterator>
+FrozenSet<T, Compare, Allocator>::FrozenSet(InputIterator first,
+                                            InputIterator last,
+                                            const Compare& comp,
+                                            const Allocator& alloc)
+    : FrozenSet(comp, alloc) {
+    std::vector<T> vals(first, last);
+    std::stable_sort(vals.begin(), vals.end(), this->comp());
+    auto equal = [this](const T& a, const T& b) { return !less_(a, b); };
+    vals.erase(std::unique(vals.begin(), vals.end(), equal), vals.end());
+    build_(vals.begin(), vals.size());
+}
+
+template<class T, class Compare, class Allocator>
+FrozenSet<T, Compare, Allocator>::FrozenSet(std::initializer_list<T> elems,
+                                            const Compare& comp,
+                                            const Allocator& alloc)
+    : FrozenSet(elems.begin(), elems.end(), comp, alloc) {}
+
+template<class T, class Compare, class Allocator>
+FrozenSet<T, Compare, Allocator>::FrozenSet(
+    const FrozenSet<T, Compare, Allocator>& s)
+    : CompareHolder<Compare>(s),
+      alloc_(KeyTraits::select_on_container_copy_construction(s.alloc_)) {
+    if (s.mapping_ != nullptr) {
+        data_ = s.data_;
+        size_ = s.size_;
+        mapping_ = s.mapping_;
+        return;
+    }
+    build_(s.begin(), s.size_);
+}
+
+template<class T, class Compare, class Allocator>
+FrozenSet<T, Compare, Allocator>::FrozenSet(
+    FrozenSet<T, Compare, Allocator>&& s) noexcept
+    : CompareHolder<Compare>(s), alloc_(s.alloc_) {
+    std::swap(s.data_, data_);
+    std::swap(s.size_, size_);
+    std::swap(s.mapping_, mapping_);
+}
+
+template<class T, class Compare, class Allocator>
+FrozenSet<T, Compare, Allocator> FrozenSet<T, Compare, Allocator>::load_mmap(
+    const std::string& path, const Compare& comp) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "keys must be trivially copyable");
+    int fd = ::open(path.c_str(), O_RDONLY);
+    FrozenSetWriter<T>::check_(fd >= 0, "open");
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::generic_category(), "fstat");
+    }
+    size_t length = static_cast<size_t>(st.st_size);
+    if (length < FrozenSetHeader::OFFSET) {
+        ::close(fd);
+        throw std::runtime_error("not a frozen set file");
+    }
+    void* base = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    int err = errno;
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        throw std::system_error(err, std::generic_category(), "mmap");
+    }
+    std::shared_ptr<const void> mapping(
+        base, [length](const void* ptr) {
+            ::munmap(const_cast<void*>(ptr), length);
+        });
+    FrozenSetHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    if (std::memcmp(header.magic, FrozenSetHeader::MAGIC,
+                    sizeof(header.magic)) != 0 ||
+        header.version != FrozenSetHeader::VERSION ||
+        header.byte_order != FrozenSetHeader::ENDIAN_MARK) {
+        throw std::runtime_error("not a frozen set file");
+    }
+    if (header.key_size != sizeof(T) || header.key_align != alignof(T) ||
+        header.offset % alignof(T) != 0 || header.offset > length ||
+        header.size > (length - header.offset) / sizeof(T)) {
+        throw std::runtime_error("frozen set file doesn't match key type");
+    }
+    FrozenSet<T, Compare, Allocator> res(comp);
+    res.data_ = reinterpret_cast<T*>(
+        const_cast<char*>(static_cast<const char*>(base)) + header.offset);
+    res.size_ = header.size;
+    res.mapping_ = std::move(mapping);
+    return res;
+}
+
+template<class T, class Compare, class Allocator>
+FrozenSet<T, Compare, Allocator>::~FrozenSet() {
+    destruct_(size_);
+}
+
+template<class T, class Compare, class Allocator>
+FrozenSet<T, Compare, Allocator>& FrozenSet<T, Compare, Allocator>::operator=(
+    const FrozenSet<T, Compare, Allocator>& s) {
+    FrozenSet<T, Compare, Allocator> copy(s);
+    *this = std::move(copy);
+    return *this;
+}
+
+template<class T, class Compare, class Allocator>
+FrozenSet<T, Compare, Allocator>& FrozenSet<T, Compare, Allocator>::operator=(
+    FrozenSet<T, Compare, Allocator>&& s) noexcept {
+    if (this == &s) {
+        return *this;
+    }
+    std::swap(static_cast<CompareHolder<Compare>&>(s),
+              static_cast<CompareHolder<Compare>&>(*this));
+    std::swap(s.alloc_, alloc_);
+    std::swap(s.data_, data_);
+    std::swap(s.size_, size_);
+    std::swap(s.mapping_, mapping_);
+    return *this;
+}
+
+template<class T, class Compare, class Allocator>
+void FrozenSet<T, Compare, Allocator>::save(const std::string& path) const {
+    FrozenSetWriter<T> writer(path, size_);
+    if (size_ != 0) {
+        // Keys are already in the order of the file.
+        std::memcpy(writer.keys_(), data_, size_ * sizeof(T));
+    }
+    writer.pushed_ = size_;
+    writer.finish();
+}
+
+template<class T, class Compare, class Allocator>
+typename FrozenSet<T, Compare, Allocator>::Iterator
+FrozenSet<T, Compare, Allocator>::begin() const {
+    return Iterator(this, first_(size_));
+}
+
+template<class T, class Compare, class Allocator>
+typename FrozenSet<T, Compare, Allocator>::Iterator
+FrozenSet<T, Compare, Allocator>::end() const {
+    return Iterator(this, 0);
+}
+
+template<class T, class Compare, class Allocator>
+typename FrozenSet<T, Compare, Allocator>::Iterator
+FrozenSet<T, Compare, Allocator>::lower_bound(const T& elem) const {
+    return Iterator(this,
+                    search_([&](const T& val) { return less_(val, elem); }));
+}
+
+template<class T, class Compare, class Allocator>
+template<class K, class C, class>
+typename FrozenSet<T, Compare, Allocator>::Iterator
+FrozenSet<T, Compare, Allocator>::lower_bound(const K& key) const {
+    return Iterator(this,
+                    search_([&](const T& val) { return less_(val, key); }));
+}
+
+template<class T, class Compare, class Allocator>
+typename FrozenSet<T, Compare, Allocator>::Iterator
+FrozenSet<T, Compare, Allocator>::upper_bound(const T& elem) const {
+    return Iterator(this,
+                    search_([&](const T& val) { return !less_(elem, val); }));
+}
+
+template<class T, class Compare, class Allocator>
+template<class K, class C, class>
+typename FrozenSet<T, Compare, Allocator>::Iterator
+FrozenSet<T, Compare, Allocator>::upper_bound(const K& key) const {
+    return Iterator(this,
+                    search_([&](const T& val) { return !less_(key, val); }));
+}
+
+template<class T, class Compare, class Allocator>
+typename FrozenSet<T, Compare, Allocator>::Iterator
+FrozenSet<T, Compare, Allocator>::find(const T& elem) const {
+    Iterator iter = lower_bound(elem);
+    if (iter.pos_ == 0 || less_(elem, at_(iter.pos_))) {
+        return end();
+    }
+    return iter;
+}
+
+template<class T, class Compare, class Allocator>
+template<class K, class C, class>
+typename FrozenSet<T, Compare, Allocator>::Iterator
+FrozenSet<T, Compare, Allocator>::find(const K& key) const {
+    Iterator iter = lower_bound(key);
+    if (iter.pos_ == 0 || less_(key, at_(iter.pos_))) {
+        return end();
+    }
+    return iter;
+}
+
+template<class T, class Compare, class Allocator>
+bool FrozenSet<T, Compare, Allocator>::contains(const T& elem) const {
+    return find(elem) != end();
+}
+
+template<class T, class Compare, class Allocator>
+template<class K, class C, class>
+bool FrozenSet<T, Compare, Allocator>::contains(const K& key) const {
+    return find(key) != end();
+}
+
+template<class T, class Compare, class Allocator>
+size_t FrozenSet<T, Compare, Allocator>::first_(size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    size_t pos = 1;
+    while (2 * pos <= n) {
+        pos = 2 * pos;
+    }
+    return pos;
+}
+
+template<class T, class Compare, class Allocator>
+size_t FrozenSet<T, Compare, Allocator>::last_(size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    size_t pos = 1;
+    while (2 * pos + 1 <= n) {
+        pos = 2 * pos + 1;
+    }
+    return pos;
+}
+
+template<class T, class Compare, class Allocator>
+size_t FrozenSet<T, Compare, Allocator>::next_(size_t pos, size_t n) {
+    if (2 * pos + 1 <= n) {
+        // The leftmost position of the right subtree.
+        pos = 2 * pos + 1;
+        while (2 * pos <= n) {
+            pos = 2 * pos;
+        }
+        return pos;
+    }
+    // The first ancestor whose left subtree holds pos.
+    while (pos & 1) {
+        pos >>= 1;
+    }
+    return pos >> 1;
+}
+
+template<class T, class Compare, class Allocator>
+size_t FrozenSet<T, Compare, Allocator>::prev_(size_t pos, size_t n) {
+    if (pos == 0) {
+        return last_(n);
+    }
+    if (2 * pos <= n) {
+        pos = 2 * pos;
+        while (2 * pos + 1 <= n) {
+            pos = 2 * pos + 1;
+        }
+        return pos;
+    }
+    while (pos > 1 && !(pos & 1)) {
+        pos >>= 1;
+    }
+    return pos >> 1;
+}
+
+template<class T, class Compare, class Allocator>
+template<class Pred>
+size_t FrozenSet<T, Compare, Allocator>::search_(Pred pred) const {
+    size_t pos = 1;
+    while (pos <= size_) {
+#if defined(__GNUC__) || defined(__clang__)
+        // Descendants of pos some levels below share one cache line.
+        if (pos * LINE_KEYS <= size_) {
+            __builtin_prefetch(&at_(pos * LINE_KEYS));
+        }
+#endif
+        pos = 2 * pos + (pred(at_(pos)) ? 1 : 0);
+    }
+    // Turns right after the last left turn are undone, the position of
+    // that left turn is the answer.
+    while (pos & 1) {
+        pos >>= 1;
+    }
+    return pos >> 1;
+}
+
+template<class T, class Compare, class Allocator>
+template<class ForwardIterator>
+void FrozenSet<T, Compare, Allocator>::build_(ForwardIterator first,
+                                              size_t count) {
+    if (count == 0) {
+        return;
+    }
+    data_ = KeyTraits::allocate(alloc_, count);
+    size_ = count;
+    size_t built = 0;
+    try {
+        for (size_t pos = first_(count); pos != 0;
+             pos = next_(pos, count), ++first, ++built) {
+            KeyTraits::construct(alloc_, data_ + pos - 1, *first);
+        }
+    } catch (...) {
+        destruct_(built);
+        throw;
+    }
+}
+
+template<class T, class Compare, class Allocator>
+void FrozenSet<T, Compare, Allocator>::destruct_(size_t count) {
+    if (mapping_ != nullptr) {
+        mapping_.reset();
+        data_ = nullptr;
+        size_ = 0;
+        return;
+    }
+    if (data_ == nullptr) {
+        return;
+    }
+    size_t pos = first_(size_);
+    for (size_t i = 0; i < count; ++i, pos = next_(pos, size_)) {
+        KeyTraits::destroy(alloc_, data_ + pos - 1);
+    }
+    KeyTraits::deallocate(alloc_, data_, size_);
+    data_ = nullptr;
+    size_ = 0;
+}
+
+template<class T, class Compare, class Allocator>
+typename FrozenSet<T, Compare, Allocator>::Iterator&
+FrozenSet<T, Compare, Allocator>::Iterator::operator++() {
+    pos_ = next_(pos_, s_->size_);
+    return *this;
+}
+
+template<class T, class Compare, class Allocator>
+typename FrozenSet<T, Compare, Allocator>::Iterator
+FrozenSet<T, Compare, Allocator>::Iterator::operator++(int) {
+    Iterator copy = *this;
+    this->operator++();
+    return copy;
+}
+
+template<class T, class Compare, class Allocator>
+typename FrozenSet<T, Compare, Allocator>::Iterator&
+FrozenSet<T, Compare, Allocator>::Iterator::operator--() {
+    pos_ = prev_(pos_, s_->size_);
+    return *this;
+}
+
+template<class T, class Compare, class Allocator>
+typename FrozenSet<T, Compare, Allocator>::Iterator
+FrozenSet<T, Compare, Allocator>::Iterator::operator--(int) {
+    Iterator copy = *this;
+    this->operator--();
+    return copy;
+}
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "tree.h"
+
+// Policy of the Set under Map: the options of Policy, with keys taken out
+// of key-value pairs.
+template<class Policy>
+struct MapPolicy : Policy {
+    using key_of = KeyFirst;
+};
+
+/**
+ *  A sorted associative container of key-value pairs with unique keys, on
+ *  the same tree as Set. Pairs live in leaves and internal nodes keep only
+ *  copies of keys, so descent never touches values. operator[],
+ *  try_emplace and insert_or_assign descend once.
+ *
+ *  @tparam K          Type of keys.
+ *  @tparam V          Type of mapped values.
+ *  @tparam Compare    Strict weak ordering of keys.
+ *  @tparam Allocator  Allocator of pairs, rebound for tree nodes and keys.
+ *  @tparam Policy     Optional features, see SetPolicy.
+ *
+ */
+
+template<class K, class V, class Compare = std::less<K>,
+         class Allocator = std::allocator<std::pair<const K, V>>,
+         class Policy = SetPolicy>
+class Map {
+  public:
+    using key_type = K;
+    using mapped_type = V;
+    using value_type = std::pair<const K, V>;
+
+  private:
+    using Tree = Set<value_type, Compare, Allocator, MapPolicy<Policy>>;
+    using Leaf = typename Tree::Leaf;
+
+  public:
+    // Bidirectional iterator over pairs, which gives mutable values unless
+    // Const is set.
+    template<bool Const>
+    class BasicIterator {
+      public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = std::pair<const K, V>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<Const, const value_type*,
+                                           value_type*>;
+        using reference = std::conditional_t<Const, const value_type&,
+                                             value_type&>;
+
+        BasicIterator() = default;
+
+        // Mutable iterators convert to constant ones.
+        template<bool C = Const, class = std::enable_if_t<C>>
+        BasicIterator(const BasicIterator<false>& iter) : it_(iter.it_) {}
+
+        // Go to next element.
+        BasicIterator& operator++() {
+            ++it_;
+            return *this;
+        }
+
+        // Go to next element.
+        BasicIterator operator++(int) {
+            BasicIterator copy = *this;
+            ++it_;
+            return copy;
+        }
+
+        // Go to previous element.
+        BasicIterator& operator--() {
+            --it_;
+            return *this;
+        }
+
+        // Go to previous element.
+        BasicIterator operator--(int) {
+            BasicIterator copy = *this;
+            --it_;
+            return copy;
+        }
+
+        // Leaves aren't const, the set exposes them as const only because
+        // its elements are keys.
+        reference operator*() const { return const_cast<reference>(*it_); }
+
+        pointer operator->() const { return &**this; }
+
+        bool operator==(const BasicIterator& iter) const {
+            return it_ == iter.it_;
+        }
+
+        bool operator!=(const BasicIterator& iter) const {
+            return it_ != iter.it_;
+        }
+
+      private:
+        friend class Map;
+
+        explicit BasicIterator(typename Tree::Iterator it) : it_(it) {}
+
+        typename Tree::Iterator it_;
+    };
+
+    using Iterator = BasicIterator<false>;
+    using ConstIterator = BasicIterator<true>;
+    using iterator = Iterator;
+    using const_iterator = ConstIterator;
+
+    Map() = default;
+
+    explicit Map(const Compare& comp, const Allocator& alloc = Allocator())
+        : tree_(comp, alloc) {}
+
+    explicit Map(const Allocator& alloc) : tree_(alloc) {}
+
+    // Keeps the first of pairs with equal keys.
+    template<class InputIterator>
+    Map(InputIterator first, InputIterator last,
+        const Compare& comp = Compare(), const Allocator& alloc = Allocator())
+        : tree_(first, last, comp, alloc) {}
+
+    Map(std::initializer_list<value_type> elems,
+        const Compare& comp = Compare(), const Allocator& alloc = Allocator())
+        : tree_(elems, comp, alloc) {}
+
+    // Return number of elements. Time: O(1).
+    inline size_t size() const { return tree_.size(); }
+
+    // Checks whether the container is empty. Time: O(1).
+    inline bool empty() const { return tree_.empty(); }
+
+    // Returns the allocator associated with the map. Time: O(1).
+    inline Allocator get_allocator() const { return tree_.get_allocator(); }
+
+    // Returns the comparator of keys. Time: O(1).
+    inline Compare key_comp() const { return tree_.key_comp(); }
+
+    // Returns value of key, inserting a value-initialized one if the map
+    // doesn't contain key. Time: O(log(n)).
+    V& operator[](const K& key);
+
+    V& operator[](K&& key);
+
+    // Returns value of key. Throws std::out_of_range if the map doesn't
+    // contain key. Time: O(log(n)).
+    V& at(const K& key);
+
+    const V& at(const K& key) const;
+
+    // Inserts pair of key and value constructed from args, if the map
+    // doesn't contain key, otherwise args are left untouched. Returns
+    // iterator to the pair with key and whether insertion took place.
+    // Time: O(log(n)).
+    template<class... Args>
+    std::pair<Iterator, bool> try_emplace(const K& key, Args&&... args);
+
+    template<class... Args>
+    std::pair<Iterator, bool> try_emplace(K&& key, Args&&... args);
+
+    // Assigns val to the value of key, inserting the pair if the map doesn't
+    // contain key. Returns iterator to the pair and whether insertion took
+    // place. Time: O(log(n)).
+    template<class M>
+    std::pair<Iterator, bool> insert_or_assign(const K& key, M&& val);
+
+    template<class M>
+    std::pair<Iterator, bool> insert_or_assign(K&& key, M&& val);
+
+    // Inserts pair, if the map doesn't contain its key. Returns iterator to
+    // the pair with the key and whether insertion took place.
+    // Time: O(log(n)).
+    std::pair<Iterator, bool> insert(const value_type& elem);
+
+    std::pair<Iterator, bool> insert(value_type&& elem);
+
+    // Same as insert, but the pair is constructed from args. Time: O(log(n)).
+    template<class... Args>
+    std::pair<Iterator, bool> emplace(Args&&... args);
+
+    // Removes the pair with key, if the map contains it. Time: O(log(n)).
+    void erase(const K& key);
+
+    // Removes the pair at pos and returns iterator to the next one.
+    // Time: O(log(n)).
+    Iterator erase(ConstIterator pos);
+
+    // Removes pairs in [first, last) and returns last. Time: O(log(n) + k)
+    // or O(log(n)) with order statistics, k is the number of pairs removed.
+    Iterator erase(ConstIterator first, ConstIterator last);
+
+    // Returns an iterator to the beginning. Time: O(1).
+    Iterator begin() { return Iterator(tree_.begin()); }
+
+    ConstIterator begin() const { return ConstIterator(tree_.begin()); }
+
+    // Returns an iterator to the end. Time: O(1).
+    Iterator end() { return Iterator(tree_.end()); }
+
+    ConstIterator end() const { return ConstIterator(tree_.end()); }
+
+    // Returns an iterator to the first pair with key not less than the given
+    // key. Time: O(log(n)).
+    Iterator lower_bound(const K& key) {
+        return Iterator(tree_iter_(tree_.lower_link_(key)));
+    }
+
+    ConstIterator lower_bound(const K& key) const {
+        return ConstIterator(tree_iter_(tree_.lower_link_(key)));
+    }
+
+    // Returns an iterator to the pair with the given key. Time: O(log(n)).
+    Iterator find(const K& key) {
+        return Iterator(tree_iter_(tree_.find_(key)));
+    }
+
+    ConstIterator find(const K& key) const {
+        return ConstIterator(tree_iter_(tree_.find_(key)));
+    }
+
+    // Checks whether the map contains the given key. Time: O(log(n)).
+    bool contains(const K& key) const {
+        return tree_.find_(key) != &tree_.END_NODE_;
+    }
+
+  private:
+    // Inserts pair of key and value made from args unless the map contains
+    // key, with one descent. Time: O(log(n)).
+    template<class Key, class... Args>
+    std::pair<Iterator, bool> try_emplace_(Key&& key, Args&&... args);
+
+    // Returns iterator of the tree pointing to link. Time: O(1).
+    typename Tree::Iterator tree_iter_(const typename Tree::Link* link) const {
+        return typename Tree::Iterator(link, &tree_);
+    }
+
+    // Returns leaf with key, or nullptr. Time: O(log(n)).
+    Leaf* find_leaf_(const K& key) const;
+
+  private:
+    Tree tree_;
+};
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+V& Map<K, V, Compare, Allocator, Policy>::operator[](const K& key) {
+    return try_emplace_(key).first->second;
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+V& Map<K, V, Compare, Allocator, Policy>::operator[](K&& key) {
+    return try_emplace_(std::move(key)).first->second;
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+V& Map<K, V, Compare, Allocator, Policy>::at(const K& key) {
+    Leaf* leaf = find_leaf_(key);
+    if (leaf == nullptr) {
+        throw std::out_of_range("key not found");
+    }
+    return leaf->val.second;
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+const V& Map<K, V, Compare, Allocator, Policy>::at(const K& key) const {
+    Leaf* leaf = find_leaf_(key);
+    if (leaf == nullptr) {
+        throw std::out_of_range("key not found");
+    }
+    return leaf->val.second;
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+template<class... Args>
+std::pair<typename Map<K, V, Compare, Allocator, Policy>::Iterator, bool>
+Map<K, V, Compare, Allocator, Policy>::try_emplace(const K& key,
+                                                   Args&&... args) {
+    return try_emplace_(key, std::forward<Args>(args)...);
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+template<class... Args>
+std::pair<typename Map<K, V, Compare, Allocator, Policy>::Iterator, bool>
+Map<K, V, Compare, Allocator, Policy>::try_emplace(K&& key, Args&&... args) {
+    return try_emplace_(std::move(key), std::forward<Args>(args)...);
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+template<class M>
+std::pair<typename Map<K, V, Compare, Allocator, Policy>::Iterator, bool>
+Map<K, V, Compare, Allocator, Policy>::insert_or_assign(const K& key,
+                                                        M&& val) {
+    std::pair<Iterator, bool> res = try_emplace_(key, std::forward<M>(val));
+    if (!res.second) {
+        res.first->second = std::forward<M>(val);
+    }
+    return res;
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+template<class M>
+std::pair<typename Map<K, V, Compare, Allocator, Policy>::Iterator, bool>
+Map<K, V, Compare, Allocator, Policy>::insert_or_assign(K&& key, M&& val) {
+    std::pair<Iterator, bool> res =
+        try_emplace_(std::move(key), std::forward<M>(val));
+    if (!res.second) {
+        res.first->second = std::forward<M>(val);
+    }
+    return res;
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+std::pair<typename Map<K, V, Compare, Allocator, Policy>::Iterator, bool>
+Map<K, V, Compare, Allocator, Policy>::insert(const value_type& elem) {
+    auto res = tree_.insert(elem);
+    return {Iterator(res.first), res.second};
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+std::pair<typename Map<K, V, Compare, Allocator, Policy>::Iterator, bool>
+Map<K, V, Compare, Allocator, Policy>::insert(value_type&& elem) {
+    auto res = tree_.insert(std::move(elem));
+    return {Iterator(res.first), res.second};
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+template<class... Args>
+std::pair<typename Map<K, V, Compare, Allocator, Policy>::Iterator, bool>
+Map<K, V, Compare, Allocator, Policy>::emplace(Args&&... args) {
+    auto res = tree_.emplace(std::forward<Args>(args)...);
+    return {Iterator(res.first), res.second};
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+void Map<K, V, Compare, Allocator, Policy>::erase(const K& key) {
+    tree_.erase_(key);
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+typename Map<K, V, Compare, Allocator, Policy>::Iterator
+Map<K, V, Compare, Allocator, Policy>::erase(ConstIterator pos) {
+    return Iterator(tree_.erase(pos.it_));
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+typename Map<K, V, Compare, Allocator, Policy>::Iterator
+Map<K, V, Compare, Allocator, Policy>::erase(ConstIterator first,
+                                             ConstIterator last) {
+    return Iterator(tree_.erase(first.it_, last.it_));
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+template<class Key, class... Args>
+std::pair<typename Map<K, V, Compare, Allocator, Policy>::Iterator, bool>
+Map<K, V, Compare, Allocator, Policy>::try_emplace_(Key&& key,
+                                                    Args&&... args) {
+    Leaf* pos = (tree_.root_ == nullptr ? nullptr : tree_.lower_bound_(key));
+    if (pos != nullptr && !tree_.less_(pos->val, key) &&
+        !tree_.less_(key, pos->val)) {
+        return {Iterator(tree_iter_(pos)), false};
+    }
+    Leaf* node = tree_.new_leaf_(
+        std::piecewise_construct, std::forward_as_tuple(std::forward<Key>(key)),
+        std::forward_as_tuple(std::forward<Args>(args)...));
+    return {Iterator(tree_iter_(tree_.link_leaf_(pos, node))), true};
+}
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+typename Map<K, V, Compare, Allocator, Policy>::Leaf*
+Map<K, V, Compare, Allocator, Policy>::find_leaf_(const K& key) const {
+    const typename Tree::Link* link = tree_.find_(key);
+    if (link == &tree_.END_NODE_) {
+        return nullptr;
+    }
+    return static_cast<Leaf*>(const_cast<typename Tree::Link*>(link));
+}
@@ -0,0 +1,783 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <utility>
+
+#include "tree.h"
+
+/**
+ *  A persistent version of Set. Nodes are immutable once shared and are
+ *  owned by reference counts, so copying the set takes O(1) and the copy is
+ *  a snapshot: insert and erase copy only the O(log(n)) nodes on the path
+ *  from the leaf to the root and leave nodes of other copies untouched.
+ *  Nodes owned by one copy only are updated in place.
+ *
+ *  There are no parent pointers and no leaf list, because a shared node has
+ *  many parents. Internal nodes keep pointers to the max keys of their sons,
+ *  which live in leaves, so path copying never copies keys.
+ *
+ *  One object must not be used by several threads at once, but different
+ *  copies may be used and destroyed concurrently, e.g. readers iterate over
+ *  snapshot() while the writer keeps changing the original. The allocator
+ *  must then be thread safe, so PoolAllocator does not fit.
+ *
+ *  @tparam T          Type of key objects.
+ *  @tparam Compare    Strict weak ordering of keys.
+ *  @tparam Allocator  Allocator of keys, rebound for tree nodes. All copies
+ *                     of the allocator must be able to free each other's
+ *                     nodes.
+ *
+ */
+
+template<class T, class Compare = std::less<T>,
+         class Allocator = std::allocator<T>>
+class PersistentSet : private CompareHolder<Compare> {
+  private:
+    static constexpr size_t MAX_SONS = 4;
+
+    // Height of a 2-3 tree with 2^64 leaves.
+    static constexpr size_t MAX_HEIGHT = 64;
+
+    // Leaves have no sons.
+    struct Node {
+        Node() = default;
+
+        mutable std::atomic<size_t> refs{1};
+        size_t sons_size = 0;
+    };
+
+    struct Leaf : Node {
+        template<class... Args>
+        explicit Leaf(Args&&... args) : val(std::forward<Args>(args)...) {}
+
+        T val;
+    };
+
+    struct Inner : Node {
+        std::array<Node*, MAX_SONS> sons;
+        std::array<const T*, MAX_SONS> keys;
+    };
+
+    using LeafAllocator =
+        typename std::allocator_traits<Allocator>::template rebind_alloc<Leaf>;
+    using InnerAllocator =
+        typename std::allocator_traits<Allocator>::template rebind_alloc<Inner>;
+    using LeafTraits = std::allocator_traits<LeafAllocator>;
+    using InnerTraits = std::allocator_traits<InnerAllocator>;
+
+  public:
+    // Forward iterator keeping the path from the root to its leaf. It stays
+    // valid while the set it came from is alive and unchanged.
+    class Iterator {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        Iterator() = default;
+
+        Iterator& operator++();
+
+        Iterator operator++(int);
+
+        const T& operator*() const;
+
+        const T* operator->() const;
+
+        bool operator==(const Iterator& iter) const;
+
+        bool operator!=(const Iterator& iter) const;
+
+      private:
+        friend class PersistentSet;
+
+        // Goes to the first leaf of node's subtree. Time: O(log(n)).
+        void leftmost_(const Node* node);
+
+        std::array<const Inner*, MAX_HEIGHT> path_;
+        std::array<uint8_t, MAX_HEIGHT> pos_;
+        size_t depth_ = 0;
+        const Leaf* leaf_ = nullptr;
+    };
+
+    explicit PersistentSet(const Compare& comp = Compare(),
+                           const Allocator& alloc = Allocator());
+
+    explicit PersistentSet(const Allocator& alloc);
+
+    template<typename InputIterator>
+    PersistentSet(InputIterator first, InputIterator last,
+                  const Compare& comp = Compare(),
+                  const Allocator& alloc = Allocator());
+
+    PersistentSet(std::initializer_list<T> elems,
+                  const Compare& comp = Compare(),
+                  const Allocator& alloc = Allocator());
+
+    // Shares all nodes with s. Time: O(1).
+    PersistentSet(const PersistentSet<T, Compare, Allocator>& s);
+
+    PersistentSet(PersistentSet<T, Compare, Allocator>&& s) noexcept;
+
+    ~PersistentSet();
+
+    // Shares all nodes with s. Time: O(1) plus freeing of the nodes only
+    // this set owned.
+    PersistentSet<T, Compare, Allocator>& operator=(
+        const PersistentSet<T, Compare, Allocator>& s);
+
+    PersistentSet<T, Compare, Allocator>& operator=(
+        PersistentSet<T, Compare, Allocator>&& s) noexcept;
+
+    // Returns copy of the set, which later changes of this set don't touch.
+    // Time: O(1).
+    PersistentSet<T, Compare, Allocator> snapshot() const;
+
+    // Return number of elements. Time: O(1).
+    inline size_t size() const { return size_; }
+
+    // Checks whether the container is empty. Time: O(1).
+    inline bool empty() const { return size_ == 0; }
+
+    Allocator get_allocator() const { return alloc_; }
+
+    Compare key_comp() const { return this->comp(); }
+
+    // Inserts element into the set, if the set doesn't already contain an
+    // element with an equivalent key. Returns whether insertion took place.
+    // Time: O(log(n)).
+    bool insert(const T& elem);
+
+    // Removes elem from the set, if the set contain it. Time: O(log(n)).
+    void erase(const T& elem);
+
+    // Returns an iterator to the beginning. Time: O(log(n)).
+    Iterator begin() const;
+
+    // Returns an iterator to the end. Time: O(1).
+    Iterator end() const;
+
+    // Returns an iterator to the first element not less than the given key.
+    // Time: O(log(n))
+    Iterator lower_bound(const T& elem) const;
+
+    // Returns an iterator to the element equal to the given key.
+    // Time: O(log(n))
+    Iterator find(const T& elem) const;
+
+    // Checks whether the set contains the given key. Time: O(log(n))
+    bool contains(const T& elem) const;
+
+  private:
+    // Compares keys with the set's comparator.
+    inline bool less_(const T& a, const T& b) const {
+        return this->comp()(a, b);
+    }
+
+    // Allocates leaf holding copy of val. Time: O(1).
+    Leaf* new_leaf_(const T& val);
+
+    // Allocates internal node without sons. Time: O(1).
+    Inner* new_inner_();
+
+    // Frees internal node, but not its sons. Time: O(1).
+    void delete_inner_(Inner* node);
+
+    // Returns copy of node sharing its sons. Time: O(1).
+    Inner* clone_(const Inner* node);
+
+    // Drops one reference to node, and frees it with the nodes only it owned
+    // once there are no references. Time: O(number of freed nodes).
+    void release_(const Node* node);
+
+    // Returns pointer to the max key of node's subtree. Time: O(1).
+    static const T* max_key_(const Node* node);
+
+    // Inserts son into node at position pos. Time: O(1).
+    static void insert_son_(Inner* node, size_t pos, Node* son);
+
+    // Removes son at position pos from node without releasing it.
+    // Time: O(1).
+    static void erase_son_(Inner* node, size_t pos);
+
+    // Descends to the leaf for key, storing internal nodes and positions
+    // of sons taken in path and pos. Returns the leaf. Time: O(log(n)).
+    const Leaf* descend_(const T& key, std::array<Inner*, MAX_HEIGHT>& path,
+                         std::array<size_t, MAX_HEIGHT>& pos,
+                         size_t& depth) const;
+
+    // Returns the first level from which nodes of path are shared with
+    // other sets and must be copied. Time: O(log(n)).
+    static size_t first_shared_(const std::array<Inner*, MAX_HEIGHT>& path,
+                                size_t depth);
+
+    // Makes writable the nodes on path, given their copies from level
+    // shared, and releases the originals. Time: O(log(n)).
+    void link_copies_(const std::array<Inner*, MAX_HEIGHT>& path,
+                      const std::array<size_t, MAX_HEIGHT>& pos,
+                      std::array<Inner*, MAX_HEIGHT>& copies, size_t depth,
+                      size_t shared);
+
+    // Recomputes keys of node from its sons. Time: O(1).
+    static void update_keys_(Inner* node);
+
+    // Returns position of the neighbour that a son at position pos takes
+    // sons from or merges into. Time: O(1).
+    static size_t bro_pos_(size_t pos) { return pos == 0 ? 1 : pos - 1; }
+
+  private:
+    Allocator alloc_;
+    LeafAllocator leaf_alloc_{alloc_};
+    InnerAllocator inner_alloc_{alloc_};
+    Node* root_ = nullptr;
+    size_t size_ = 0;
+};
+
+template<class T, class Compare, class Allocator>
+PersistentSet<T, Compare, Allocator>::PersistentSet(const Compare& comp,
+                                                    const Allocator& alloc)
+    : CompareHolder<Compare>(comp), alloc_(alloc) {}
+
+template<class T, class Compare, class Allocator>
+PersistentSet<T, Compare, Allocator>::PersistentSet(const Allocator& alloc)
+    : alloc_(alloc) {}
+
+template<class T, class Compare, class Allocator>
+template<typename InputIterator>
+PersistentSet<T, Compare, Allocator>::PersistentSet(InputIterator first,
+                                                    InputIterator last,
+                                                    const Compare& comp,
+                                                    const Allocator& alloc)
+    : PersistentSet(comp, alloc) {
+    for (; first != last; ++first) {
+        insert(*first);
+    }
+}
+
+template<class T, class Compare, class Allocator>
+PersistentSet<T, Compare, Allocator>::PersistentSet(
+    std::initializer_list<T> elems, const Compare& comp,
+    const Allocator& alloc)
+    : PersistentSet(elems.begin(), elems.end(), comp, alloc) {}
+
+template<class T, class Compare, class Allocator>
+PersistentSet<T, Compare, Allocator>::PersistentSet(
+    const PersistentSet<T, Compare, Allocator>& s)
+    : CompareHolder<Compare>(s), alloc_(s.alloc_) {
+    if (s.root_ != nullptr) {
+        s.root_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    root_ = s.root_;
+    size_ = s.size_;
+}
+
+template<class T, class Compare, class Allocator>
+PersistentSet<T, Compare, Allocator>::PersistentSet(
+    PersistentSet<T, Compare, Allocator>&& s) noexcept
+    : CompareHolder<Compare>(s),
+      alloc_(s.alloc_),
+      leaf_alloc_(s.leaf_alloc_),
+      inner_alloc_(s.inner_alloc_) {
+    // Allocators are copied, which doesn't throw, so s can still allocate.
+    std::swap(s.root_, root_);
+    std::swap(s.size_, size_);
+}
+
+template<class T, class Compare, class Allocator>
+PersistentSet<T, Compare, Allocator>::~PersistentSet() {
+    if (root_ != nullptr) {
+        release_(root_);
+    }
+}
+
+template<class T, class Compare, class Allocator>
+PersistentSet<T, Compare, Allocator>&
+PersistentSet<T, Compare, Allocator>::operator=(
+    const PersistentSet<T, Compare, Allocator>& s) {
+    PersistentSet<T, Compare, Allocator> copy(s);
+    *this = std::move(copy);
+    return *this;
+}
+
+template<class T, class Compare, class Allocator>
+PersistentSet<T, Compare, Allocator>&
+PersistentSet<T, Compare, Allocator>::operator=(
+    PersistentSet<T, Compare, Allocator>&& s) noexcept {
+    if (this == &s) {
+        return *this;
+    }
+    std::swap(static_cast<CompareHolder<Compare>&>(s),
+              static_cast<CompareHolder<Compare>&>(*this));
+    std::swap(s.alloc_, alloc_);
+    std::swap(s.leaf_alloc_, leaf_alloc_);
+    std::swap(s.inner_alloc_, inner_alloc_);
+    std::swap(s.root_, root_);
+    std::swap(s.size_, size_);
+    return *this;
+}
+
+template<class T, class Compare, class Allocator>
+PersistentSet<T, Compare, Allocator>
+PersistentSet<T, Compare, Allocator>::snapshot() const {
+    return *this;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentSet<T, Compare, Allocator>::Leaf*
+PersistentSet<T, Compare, Allocator>::new_leaf_(const T& val) {
+    Leaf* node = LeafTraits::allocate(leaf_alloc_, 1);
+    try {
+        LeafTraits::construct(leaf_alloc_, node, val);
+    } catch (...) {
+        LeafTraits::deallocate(leaf_alloc_, node, 1);
+        throw;
+    }
+    return node;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentSet<T, Compare, Allocator>::Inner*
+PersistentSet<T, Compare, Allocator>::new_inner_() {
+    Inner* node = InnerTraits::allocate(inner_alloc_, 1);
+    InnerTraits::construct(inner_alloc_, node);
+    return node;
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentSet<T, Compare, Allocator>::delete_inner_(Inner* node) {
+    InnerTraits::destroy(inner_alloc_, node);
+    InnerTraits::deallocate(inner_alloc_, node, 1);
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentSet<T, Compare, Allocator>::Inner*
+PersistentSet<T, Compare, Allocator>::clone_(const Inner* node) {
+    Inner* copy = new_inner_();
+    copy->sons_size = node->sons_size;
+    for (size_t i = 0; i < node->sons_size; ++i) {
+        copy->sons[i] = node->sons[i];
+        copy->keys[i] = node->keys[i];
+        copy->sons[i]->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    return copy;
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentSet<T, Compare, Allocator>::release_(const Node* node) {
+    if (node->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    if (node->sons_size == 0) {
+        Leaf* leaf = static_cast<Leaf*>(const_cast<Node*>(node));
+        LeafTraits::destroy(leaf_alloc_, leaf);
+        LeafTraits::deallocate(leaf_alloc_, leaf, 1);
+        return;
+    }
+    Inner* inner = static_cast<Inner*>(const_cast<Node*>(node));
+    for (size_t i = 0; i < inner->sons_size; ++i) {
+        release_(inner->sons[i]);
+    }
+    delete_inner_(inner);
+}
+
+template<class T, class Compare, class Allocator>
+const T* PersistentSet<T, Compare, Allocator>::max_key_(const Node* node) {
+    if (node->sons_size == 0) {
+        return &static_cast<const Leaf*>(node)->val;
+    }
+    const Inner* inner = static_cast<const Inner*>(node);
+    return inner->keys[inner->sons_size - 1];
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentSet<T, Compare, Allocator>::insert_son_(Inner* node,
+                                                       size_t pos, Node* son) {
+    for (size_t i = node->sons_size; i > pos; --i) {
+        node->sons[i] = node->sons[i - 1];
+        node->keys[i] = node->keys[i - 1];
+    }
+    node->sons[pos] = son;
+    node->keys[pos] = max_key_(son);
+    ++node->sons_size;
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentSet<T, Compare, Allocator>::erase_son_(Inner* node,
+                                                      size_t pos) {
+    --node->sons_size;
+    for (size_t i = pos; i < node->sons_size; ++i) {
+        node->sons[i] = node->sons[i + 1];
+        node->keys[i] = node->keys[i + 1];
+    }
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentSet<T, Compare, Allocator>::update_keys_(Inner* node) {
+    for (size_t i = 0; i < node->sons_size; ++i) {
+        node->keys[i] = max_key_(node->sons[i]);
+    }
+}
+
+template<class T, class Compare, class Allocator>
+const typename PersistentSet<T, Compare, Allocator>::Leaf*
+PersistentSet<T, Compare, Allocator>::descend_(
+    const T& key, std::array<Inner*, MAX_HEIGHT>& path,
+    std::array<size_t, MAX_HEIGHT>& pos, size_t& depth) const {
+    Node* node = root_;
+    for (depth = 0; node->sons_size; ++depth) {
+        Inner* inner = static_cast<Inner*>(node);
+        size_t i = 0;
+        while (i + 1 < inner->sons_size && less_(*inner->keys[i], key)) {
+            ++i;
+        }
+        path[depth] = inner;
+        pos[depth] = i;
+        node = inner->sons[i];
+    }
+    return static_cast<const Leaf*>(node);
+}
+
+template<class T, class Compare, class Allocator>
+size_t PersistentSet<T, Compare, Allocator>::first_shared_(
+    const std::array<Inner*, MAX_HEIGHT>& path, size_t depth) {
+    // Sons of a shared node are shared too, even with one reference. The
+    // acquire pairs with the release by the last other owner, so its reads
+    // of a node are done before the node changes in place.
+    for (size_t d = 0; d < depth; ++d) {
+        if (path[d]->refs.load(std::memory_order_acquire) != 1) {
+            return d;
+        }
+    }
+    return depth;
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentSet<T, Compare, Allocator>::link_copies_(
+    const std::array<Inner*, MAX_HEIGHT>& path,
+    const std::array<size_t, MAX_HEIGHT>& pos,
+    std::array<Inner*, MAX_HEIGHT>& copies, size_t depth, size_t shared) {
+    for (size_t d = 0; d < shared; ++d) {
+        copies[d] = path[d];
+    }
+    for (size_t d = shared; d < depth; ++d) {
+        if (d == 0) {
+            root_ = copies[0];
+        } else {
+            copies[d - 1]->sons[pos[d - 1]] = copies[d];
+        }
+    }
+    // Each original lost the reference of its parent or of its parent's
+    // copy.
+    for (size_t d = shared; d < depth; ++d) {
+        release_(path[d]);
+    }
+}
+
+template<class T, class Compare, class Allocator>
+bool PersistentSet<T, Compare, Allocator>::insert(const T& elem) {
+    if (root_ == nullptr) {
+        root_ = new_leaf_(elem);
+        ++size_;
+        return true;
+    }
+    std::array<Inner*, MAX_HEIGHT> path;
+    std::array<size_t, MAX_HEIGHT> pos;
+    size_t depth;
+    const Leaf* leaf = descend_(elem, path, pos, depth);
+    if (!less_(leaf->val, elem) && !less_(elem, leaf->val)) {
+        return false;
+    }
+
+    // Everything that may throw is allocated before the tree changes: the
+    // new leaf, copies of shared nodes and a node for every split. Splits
+    // climb through the nodes with 3 sons above the leaf.
+    size_t shared = first_shared_(path, depth);
+    size_t splits = 0;
+    while (splits < depth &&
+           path[depth - 1 - splits]->sons_size == MAX_SONS - 1) {
+        ++splits;
+    }
+    size_t spares_size = splits + (splits == depth ? 1 : 0);
+    std::array<Inner*, MAX_HEIGHT> copies{};
+    std::array<Inner*, MAX_HEIGHT + 1> spares{};
+    Leaf* fresh = nullptr;
+    try {
+        for (size_t d = shared; d < depth; ++d) {
+            copies[d] = clone_(path[d]);
+        }
+        for (size_t i = 0; i < spares_size; ++i) {
+            spares[i] = new_inner_();
+        }
+        fresh = new_leaf_(elem);
+    } catch (...) {
+        for (size_t d = shared; d < depth && copies[d] != nullptr; ++d) {
+            release_(copies[d]);
+        }
+        for (size_t i = 0; i < spares_size && spares[i] != nullptr; ++i) {
+            delete_inner_(spares[i]);
+        }
+        throw;
+    }
+
+    ++size_;
+    bool after = less_(leaf->val, elem);
+    if (depth == 0) {
+        Inner* root = spares[0];
+        insert_son_(root, 0, root_);
+        insert_son_(root, after ? 1 : 0, fresh);
+        root_ = root;
+        return true;
+    }
+    link_copies_(path, pos, copies, depth, shared);
+    insert_son_(copies[depth - 1], pos[depth - 1] + (after ? 1 : 0), fresh);
+    Inner* right = nullptr;
+    size_t spare = 0;
+    for (size_t d = depth; d-- > 0;) {
+        Inner* node = copies[d];
+        if (d + 1 < depth) {
+            node->keys[pos[d]] = max_key_(copies[d + 1]);
+            if (right != nullptr) {
+                insert_son_(node, pos[d] + 1, right);
+            }
+        }
+        right = nullptr;
+        if (node->sons_size == MAX_SONS) {
+            right = spares[spare++];
+            insert_son_(right, 0, node->sons[2]);
+            insert_son_(right, 1, node->sons[3]);
+            node->sons_size = 2;
+        }
+    }
+    if (right != nullptr) {
+        Inner* root = spares[spare];
+        insert_son_(root, 0, copies[0]);
+        insert_son_(root, 1, right);
+        root_ = root;
+    }
+    return true;
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentSet<T, Compare, Allocator>::erase(const T& elem) {
+    if (root_ == nullptr) {
+        return;
+    }
+    std::array<Inner*, MAX_HEIGHT> path;
+    std::array<size_t, MAX_HEIGHT> pos;
+    size_t depth;
+    const Leaf* leaf = descend_(elem, path, pos, depth);
+    if (less_(leaf->val, elem) || less_(elem, leaf->val)) {
+        return;
+    }
+    if (depth == 0) {
+        release_(root_);
+        root_ = nullptr;
+        --size_;
+        return;
+    }
+
+    // As in insert, copies are made before the tree changes. A node left
+    // with 1 son takes one from its neighbour if it has 3, or else merges
+    // into it, so the neighbour changes and must be writable. Only merges
+    // make the parent lose a son.
+    size_t shared = first_shared_(path, depth);
+    std::array<Inner*, MAX_HEIGHT> copies{};
+    std::array<Inner*, MAX_HEIGHT> bros{};
+    size_t fixes = 0;
+    for (size_t d = depth; d-- > 1 && path[d]->sons_size == 2; ++fixes) {
+        if (path[d - 1]->sons[bro_pos_(pos[d - 1])]->sons_size == 3) {
+            ++fixes;
+            break;
+        }
+    }
+    try {
+        for (size_t d = shared; d < depth; ++d) {
+            copies[d] = clone_(path[d]);
+        }
+        for (size_t i = 0; i < fixes; ++i) {
+            size_t d = depth - 2 - i;
+            Inner* bro = static_cast<Inner*>(path[d]->sons[bro_pos_(pos[d])]);
+            if (d >= shared || bro->refs.load(std::memory_order_acquire) != 1) {
+                bros[d] = clone_(bro);
+            }
+        }
+    } catch (...) {
+        for (size_t d = shared; d < depth && copies[d] != nullptr; ++d) {
+            release_(copies[d]);
+        }
+        for (size_t d = 0; d < depth; ++d) {
+            if (bros[d] != nullptr) {
+                release_(bros[d]);
+            }
+        }
+        throw;
+    }
+
+    --size_;
+    link_copies_(path, pos, copies, depth, shared);
+    erase_son_(copies[depth - 1], pos[depth - 1]);
+    for (size_t d = depth - 1; d-- > 0;) {
+        Inner* parent = copies[d];
+        Inner* son = copies[d + 1];
+        if (son->sons_size == 1) {
+            size_t b = bro_pos_(pos[d]);
+            if (bros[d] != nullptr) {
+                release_(parent->sons[b]);
+                parent->sons[b] = bros[d];
+            }
+            Inner* bro = static_cast<Inner*>(parent->sons[b]);
+            if (bro->sons_size == 3 && b < pos[d]) {
+                insert_son_(son, 0, bro->sons[2]);
+                erase_son_(bro, 2);
+            } else if (bro->sons_size == 3) {
+                insert_son_(son, 1, bro->sons[0]);
+                erase_son_(bro, 0);
+            } else {
+                insert_son_(bro, b < pos[d] ? bro->sons_size : 0,
+                            son->sons[0]);
+                erase_son_(parent, pos[d]);
+                delete_inner_(son);
+            }
+        }
+        update_keys_(parent);
+    }
+    if (copies[0]->sons_size == 1) {
+        root_ = copies[0]->sons[0];
+        delete_inner_(copies[0]);
+    }
+    release_(leaf);
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentSet<T, Compare, Allocator>::Iterator
+PersistentSet<T, Compare, Allocator>::begin() const {
+    Iterator iter;
+    if (root_ != nullptr) {
+        iter.leftmost_(root_);
+    }
+    return iter;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentSet<T, Compare, Allocator>::Iterator
+PersistentSet<T, Compare, Allocator>::end() const {
+    return Iterator();
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentSet<T, Compare, Allocator>::Iterator
+PersistentSet<T, Compare, Allocator>::lower_bound(const T& elem) const {
+    Iterator iter;
+    if (root_ == nullptr) {
+        return iter;
+    }
+    const Node* node = root_;
+    while (node->sons_size) {
+        const Inner* inner = static_cast<const Inner*>(node);
+        size_t i = 0;
+        while (i < inner->sons_size && less_(*inner->keys[i], elem)) {
+            ++i;
+        }
+        if (i == inner->sons_size) {
+            return Iterator();
+        }
+        iter.path_[iter.depth_] = inner;
+        iter.pos_[iter.depth_++] = static_cast<uint8_t>(i);
+        node = inner->sons[i];
+    }
+    const Leaf* leaf = static_cast<const Leaf*>(node);
+    if (less_(leaf->val, elem)) {
+        return Iterator();
+    }
+    iter.leaf_ = leaf;
+    return iter;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentSet<T, Compare, Allocator>::Iterator
+PersistentSet<T, Compare, Allocator>::find(const T& elem) const {
+    Iterator iter = lower_bound(elem);
+    if (iter.leaf_ == nullptr || less_(elem, iter.leaf_->val)) {
+        return Iterator();
+    }
+    return iter;
+}
+
+template<class T, class Compare, class Allocator>
+bool PersistentSet<T, Compare, Allocator>::contains(const T& elem) const {
+    if (root_ == nullptr) {
+        return false;
+    }
+    std::array<Inner*, MAX_HEIGHT> path;
+    std::array<size_t, MAX_HEIGHT> pos;
+    size_t depth;
+    const Leaf* leaf = descend_(elem, path, pos, depth);
+    return !less_(leaf->val, elem) && !less_(elem, leaf->val);
+}
+
+template<class T, class Compare, class Allocator>
+void PersistentSet<T, Compare, Allocator>::Iterator::leftmost_(
+    const Node* node) {
+    while (node->sons_size) {
+        const Inner* inner = static_cast<const Inner*>(node);
+        path_[depth_] = inner;
+        pos_[depth_++] = 0;
+        node = inner->sons[0];
+    }
+    leaf_ = static_cast<const Leaf*>(node);
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentSet<T, Compare, Allocator>::Iterator&
+PersistentSet<T, Compare, Allocator>::Iterator::operator++() {
+    while (depth_ > 0) {
+        size_t d = depth_ - 1;
+        if (static_cast<size_t>(pos_[d]) + 1 < path_[d]->sons_size) {
+            ++pos_[d];
+            leftmost_(path_[d]->sons[pos_[d]]);
+            return *this;
+        }
+        --depth_;
+    }
+    leaf_ = nullptr;
+    return *this;
+}
+
+template<class T, class Compare, class Allocator>
+typename PersistentSet<T, Compare, Allocator>::Iterator
+PersistentSet<T, Compare, Allocator>::Iterator::operator++(int) {
+    Iterator copy = *this;
+    this->operator++();
+    return copy;
+}
+
+template<class T, class Compare, class Allocator>
+const T& PersistentSet<T, Compare, Allocator>::Iterator::operator*() const {
+    return leaf_->val;
+}
+
+template<class T, class Compare, class Allocator>
+const T* PersistentSet<T, Compare, Allocator>::Iterator::operator->() const {
+    return &leaf_->val;
+}
+
+template<class T, class Compare, class Allocator>
+bool PersistentSet<T, Compare, Allocator>::Iterator::operator==(
+    const Iterator& iter) const {
+    return leaf_ == iter.leaf_;
+}
+
+template<class T, class Compare, class Allocator>
+bool PersistentSet<T, Compare, Allocator>::Iterator::operator!=(
+    const Iterator& iter) const {
+    return leaf_ != iter.leaf_;
+}
@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "concurrent_set.h"
+
+namespace {
+
+constexpr int THREADS = 8;
+
+TEST(ConcurrentSetTest, MatchesStdSetOnOneThread) {
+    ConcurrentSet<int64_t> s;
+    std::set<int64_t> expected;
+    std::mt19937 gen(1);
+    for (int i = 0; i < 100000; ++i) {
+        int64_t key = gen() % 5000;
+        switch (gen() % 3) {
+            case 0:
+                ASSERT_EQ(s.insert(key), expected.insert(key).second);
+                break;
+            case 1:
+                ASSERT_EQ(s.erase(key), expected.erase(key) == 1);
+                break;
+            default: {
+                ASSERT_EQ(s.contains(key), expected.count(key) == 1);
+                auto lower = s.lower_bound(key);
+                auto it = expected.lower_bound(key);
+                ASSERT_EQ(lower.has_value(), it != expected.end());
+                if (lower) {
+                    ASSERT_EQ(*lower, *it);
+                }
+                break;
+            }
+        }
+    }
+    EXPECT_EQ(s.size(), expected.size());
+}
+
+// Every thread changes its own keys, key % THREADS == thread, and reads all
+// of them. In the end the set holds the union of what the threads kept.
+TEST(ConcurrentSetTest, WritersOfDisjointKeys) {
+    constexpr int64_t RANGE = 20000;
+    ConcurrentSet<int64_t> s;
+    std::vector<std::set<int64_t>> kept(THREADS);
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t) {
+        threads.emplace_back([&, t]() {
+            std::mt19937 gen(t);
+            for (int i = 0; i < 50000; ++i) {
+                int64_t key = (gen() % (RANGE / THREADS)) * THREADS + t;
+                switch (gen() % 4) {
+                    case 0:
+                        if (s.insert(key) != kept[t].insert(key).second) {
+                            failed = true;
+                        }
+                        break;
+                    case 1:
+                        if (s.erase(key) != (kept[t].erase(key) == 1)) {
+                            failed = true;
+                        }
+                        break;
+                    case 2:
+                        if (s.contains(key) != (kept[t].count(key) == 1)) {
+                            failed = true;
+                        }
+                        break;
+                    default: {
+                        int64_t other = gen() % RANGE;
+                        auto lower = s.lower_bound(other);
+                        if (lower && *lower < other) {
+                            failed = true;
+                        }
+                        break;
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    EXPECT_FALSE(failed);
+    std::set<int64_t> expected;
+    for (const auto& keys : kept) {
+        expected.insert(keys.begin(), keys.end());
+    }
+    EXPECT_EQ(s.size(), expected.size());
+    for (int64_t key = 0; key < RANGE; ++key) {
+        ASSERT_EQ(s.contains(key), expected.count(key) == 1) << key;
+    }
+    for (int64_t key = -1; key < RANGE; key += 97) {
+        auto lower = s.lower_bound(key);
+        auto it = expected.lower_bound(key);
+        ASSERT_EQ(lower.has_value(), it != expected.end());
+        if (lower) {
+            ASSERT_EQ(*lower, *it);
+        }
+    }
+}
+
+// Even keys are never erased, so readers must always find them while
+// writers insert and erase odd keys around them, splitting and emptying
+// leaves.
+TEST(ConcurrentSetTest, ReadersSeeStableKeys) {
+    constexpr int64_t RANGE = 20000;
+    ConcurrentSet<int64_t> s;
+    for (int64_t key = 0; key < RANGE; key += 2) {
+        s.insert(key);
+    }
+    std::atomic<bool> stop{false};
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS / 2; ++t) {
+        threads.emplace_back([&, t]() {
+            std::mt19937 gen(100 + t);
+            for (int i = 0; i < 100000; ++i) {
+                int64_t key = (gen() % (RANGE / 2)) * 2 + 1;
+                if (gen() % 2 == 0) {
+                    s.insert(key);
+                } else {
+                    s.erase(key);
+                }
+            }
+        });
+    }
+    for (int t = 0; t < THREADS / 2; ++t) {
+        threads.emplace_back([&, t]() {
+            std::mt19937 gen(200 + t);
+            while (!stop) {
+                int64_t key = (gen() % (RANGE / 2)) * 2;
+                if (!s.contains(key)) {
+                    failed = true;
+                }
+                // key is always there, so the lower bound of key - 1 is
+                // either key - 1 or key.
+                auto lower = s.lower_bound(key - 1);
+                if (!lower || *lower < key - 1 || *lower > key) {
+                    failed = true;
+                }
+            }
+        });
+    }
+    for (int t = 0; t < THREADS / 2; ++t) {
+        threads[t].join();
+    }
+    stop = true;
+    for (size_t t = THREADS / 2; t < threads.size(); ++t) {
+        threads[t].join();
+    }
+    EXPECT_FALSE(failed);
+    for (int64_t key = 0; key < RANGE; key += 2) {
+        ASSERT_TRUE(s.contains(key));
+    }
+}
+
+struct Counted {
+    static void reclaim(void* ctx, void* ptr) {
+        static_cast<std::atomic<int>*>(ctx)->fetch_add(1);
+        delete static_cast<Counted*>(ptr);
+    }
+};
+
+TEST(EpochDomainTest, FreesOnlyAfterOlderGuardsUnpin) {
+    std::atomic<int> freed{0};
+    {
+        EpochDomain domain;
+        {
+            EpochDomain::Guard reader = domain.pin();
+            {
+                EpochDomain::Guard writer = domain.pin();
+                writer.retire(new Counted, Counted::reclaim, &freed);
+            }
+            for (int i = 0; i < 10; ++i) {
+                domain.collect();
+            }
+            EXPECT_EQ(freed, 0);
+        }
+        for (int i = 0; i < 10; ++i) {
+            domain.collect();
+        }
+        EXPECT_EQ(freed, 1);
+
+        // Whatever is left is freed with the domain.
+        domain.pin().retire(new Counted, Counted::reclaim, &freed);
+    }
+    EXPECT_EQ(freed, 2);
+}
+
+TEST(EpochDomainTest, ManyThreadsRetire) {
+    constexpr int PER_THREAD = 10000;
+    std::atomic<int> freed{0};
+    {
+        EpochDomain domain;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; ++t) {
+            threads.emplace_back([&]() {
+                for (int i = 0; i < PER_THREAD; ++i) {
+                    EpochDomain::Guard guard = domain.pin();
+                    guard.retire(new Counted, Counted::reclaim, &freed);
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        EXPECT_LE(freed, THREADS * PER_THREAD);
+    }
+    EXPECT_EQ(freed, THREADS * PER_THREAD);
+}
+
+// Objects retired by a thread that went away are freed by the threads that
+// move the epoch, without collect.
+TEST(EpochDomainTest, FreesBatchesOfIdleThreads) {
+    constexpr int IDLE = 10;
+    std::atomic<int> freed{0};
+    EpochDomain domain;
+    std::thread([&]() {
+        for (int i = 0; i < IDLE; ++i) {
+            domain.pin().retire(new Counted, Counted::reclaim, &freed);
+        }
+    }).join();
+    EXPECT_EQ(freed, 0);
+    for (size_t i = 0; i < 4 * EpochDomain::RETIRE_BATCH; ++i) {
+        domain.pin().retire(new Counted, Counted::reclaim, &freed);
+    }
+    EXPECT_GE(freed, IDLE + int(EpochDomain::RETIRE_BATCH));
+}
+
+// A thread keeps a record per domain, which must not be reused by a new
+// domain at the same address.
+TEST(EpochDomainTest, ThreadOutlivesDomains) {
+    std::atomic<int> freed{0};
+    for (int i = 0; i < 100; ++i) {
+        EpochDomain domain;
+        EpochDomain::Guard outer = domain.pin();
+        domain.pin().retire(new Counted, Counted::reclaim, &freed);
+    }
+    EXPECT_EQ(freed, 100);
+}
+
+}  // namespace
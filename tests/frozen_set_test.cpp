@@ -0,0 +1,90 @@
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "frozen_set.h"
+
+namespace {
+
+// Checks that s holds the keys of expected and searches like it.
+template<class F>
+void expect_equal(const F& s, const std::set<uint64_t>& expected) {
+    ASSERT_EQ(s.size(), expected.size());
+    auto jt = expected.begin();
+    for (uint64_t key : s) {
+        ASSERT_EQ(key, *jt++);
+    }
+    std::vector<uint64_t> backward;
+    for (auto it = s.end(); it != s.begin();) {
+        backward.push_back(*--it);
+    }
+    ASSERT_TRUE(std::equal(backward.begin(), backward.end(),
+                           expected.rbegin(), expected.rend()));
+    std::mt19937_64 gen(9);
+    for (int i = 0; i < 5000; ++i) {
+        uint64_t key = gen() % 200000;
+        ASSERT_EQ(s.contains(key), expected.count(key) == 1);
+        auto lower = expected.lower_bound(key);
+        auto it = s.lower_bound(key);
+        ASSERT_EQ(it == s.end(), lower == expected.end());
+        if (lower != expected.end()) {
+            ASSERT_EQ(*it, *lower);
+        }
+        auto upper = expected.upper_bound(key);
+        it = s.upper_bound(key);
+        ASSERT_EQ(it == s.end(), upper == expected.end());
+        if (upper != expected.end()) {
+            ASSERT_EQ(*it, *upper);
+        }
+    }
+}
+
+TEST(FrozenSetTest, MatchesStdSet) {
+    std::mt19937_64 gen(1);
+    for (size_t n : {size_t(0), size_t(1), size_t(7), size_t(1000),
+                     size_t(50000)}) {
+        std::vector<uint64_t> keys;
+        for (size_t i = 0; i < n; ++i) {
+            keys.push_back(gen() % 200000);
+        }
+        std::set<uint64_t> expected(keys.begin(), keys.end());
+        Set<uint64_t> set(keys.begin(), keys.end());
+        expect_equal(FrozenSet<uint64_t>(set), expected);
+        expect_equal(FrozenSet<uint64_t>(keys.begin(), keys.end()), expected);
+        expect_equal(FrozenSet<uint64_t>(assume_sorted, expected.begin(),
+                                         expected.end()),
+                     expected);
+        FrozenSet<uint64_t> frozen(set);
+        FrozenSet<uint64_t> copy(frozen);
+        expect_equal(copy, expected);
+    }
+}
+
+TEST(FrozenSetTest, SaveAndLoad) {
+    std::mt19937_64 gen(2);
+    std::set<uint64_t> expected;
+    for (int i = 0; i < 30000; ++i) {
+        expected.insert(gen() % 200000);
+    }
+    std::string path = ::testing::TempDir() + "frozen_set_test.bin";
+    FrozenSet<uint64_t>(assume_sorted, expected.begin(), expected.end())
+        .save(path);
+    {
+        FrozenSet<uint64_t> mapped = FrozenSet<uint64_t>::load_mmap(path);
+        expect_equal(mapped, expected);
+        FrozenSet<uint64_t> copy(mapped);
+        expect_equal(copy, expected);
+    }
+    // Keys of another size don't match the file.
+    EXPECT_THROW(FrozenSet<uint32_t>::load_mmap(path), std::runtime_error);
+    std::remove(path.c_str());
+    EXPECT_ANY_THROW(FrozenSet<uint64_t>::load_mmap(path));
+}
+
+}  // namespace
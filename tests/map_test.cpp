@@ -0,0 +1,144 @@
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <gtest/gtest.h>
+
+#include "map.h"
+
+namespace {
+
+template<class M>
+class MapTest : public ::testing::Test {
+  protected:
+    static void expect_equal(const M& m,
+                             const std::map<int, std::string>& expected) {
+        ASSERT_EQ(m.size(), expected.size());
+        auto jt = expected.begin();
+        for (const auto& [key, val] : m) {
+            ASSERT_EQ(key, jt->first);
+            ASSERT_EQ(val, jt->second);
+            ++jt;
+        }
+    }
+};
+
+using Maps = ::testing::Types<
+    Map<int, std::string>,
+    Map<int, std::string, std::less<int>,
+        PoolAllocator<std::pair<const int, std::string>>>,
+    Map<int, std::string, std::less<int>,
+        std::allocator<std::pair<const int, std::string>>,
+        OrderStatisticsPolicy>,
+    Map<int, std::string, std::less<int>,
+        std::allocator<std::pair<const int, std::string>>,
+        FanoutPolicy<4, 8>>>;
+
+TYPED_TEST_SUITE(MapTest, Maps);
+
+TYPED_TEST(MapTest, MatchesStdMap) {
+    TypeParam m;
+    std::map<int, std::string> expected;
+    std::mt19937 gen(3);
+    for (int i = 0; i < 50000; ++i) {
+        int key = static_cast<int>(gen() % 3000);
+        std::string val = std::to_string(i);
+        switch (gen() % 7) {
+            case 0:
+                m[key] += "a";
+                expected[key] += "a";
+                break;
+            case 1: {
+                auto res = m.try_emplace(key, val);
+                auto want = expected.try_emplace(key, val);
+                ASSERT_EQ(res.second, want.second);
+                ASSERT_EQ(res.first->second, want.first->second);
+                break;
+            }
+            case 2: {
+                auto res = m.insert_or_assign(key, val);
+                ASSERT_EQ(res.second, expected.insert_or_assign(key, val).second);
+                ASSERT_EQ(res.first->second, val);
+                break;
+            }
+            case 3:
+                ASSERT_EQ(m.insert({key, val}).second,
+                          expected.insert({key, val}).second);
+                break;
+            case 4:
+                m.erase(key);
+                expected.erase(key);
+                break;
+            case 5: {
+                auto it = m.lower_bound(key);
+                auto jt = expected.lower_bound(key);
+                ASSERT_EQ(it == m.end(), jt == expected.end());
+                if (jt != expected.end()) {
+                    ASSERT_EQ(it->first, jt->first);
+                    ASSERT_EQ(it->second, jt->second);
+                }
+                break;
+            }
+            default:
+                ASSERT_EQ(m.contains(key), expected.count(key) == 1);
+                ASSERT_EQ(m.find(key) != m.end(), expected.count(key) == 1);
+                break;
+        }
+    }
+    this->expect_equal(m, expected);
+
+    auto first = m.lower_bound(1000);
+    auto last = m.lower_bound(2000);
+    m.erase(first, last);
+    expected.erase(expected.lower_bound(1000), expected.lower_bound(2000));
+    this->expect_equal(m, expected);
+}
+
+TYPED_TEST(MapTest, AccessAndIterators) {
+    TypeParam m{{3, "c"}, {1, "a"}, {2, "b"}, {1, "z"}};
+    ASSERT_EQ(m.size(), 3u);
+    EXPECT_EQ(m.at(1), "a");
+    const TypeParam& cm = m;
+    EXPECT_EQ(cm.at(3), "c");
+    EXPECT_THROW(cm.at(4), std::out_of_range);
+    EXPECT_THROW(m.at(0), std::out_of_range);
+
+    // Values are mutable through iterators, keys are not.
+    for (auto& [key, val] : m) {
+        val += std::to_string(key);
+    }
+    EXPECT_EQ(m.at(2), "b2");
+    typename TypeParam::ConstIterator it = m.find(2);
+    EXPECT_EQ(it->second, "b2");
+    EXPECT_EQ(cm.find(4), cm.end());
+
+    auto res = m.try_emplace(4, "d");
+    EXPECT_TRUE(res.second);
+    EXPECT_EQ(m.at(4), "d");
+
+    auto next = m.erase(m.find(1));
+    EXPECT_EQ(next->first, 2);
+    EXPECT_EQ(m.emplace(5, "e").first->second, "e");
+    EXPECT_FALSE(m.emplace(5, "f").second);
+    EXPECT_EQ(m.size(), 4u);
+}
+
+TEST(MapMoveTest, TryEmplaceLeavesArgumentsOnFailure) {
+    Map<std::string, std::string> m;
+    m["a"] = "1";
+    std::string key = "a";
+    std::string val = "2";
+    auto res = m.try_emplace(std::move(key), std::move(val));
+    EXPECT_FALSE(res.second);
+    EXPECT_EQ(key, "a");
+    EXPECT_EQ(val, "2");
+    EXPECT_EQ(m["a"], "1");
+    m[std::string("b")] = "3";
+    EXPECT_EQ(m.size(), 2u);
+    m.insert_or_assign(std::string("b"), "4");
+    EXPECT_EQ(m.at("b"), "4");
+}
+
+}  // namespace
@@ -0,0 +1,82 @@
+#include <random>
+#include <set>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "persistent_set.h"
+
+namespace {
+
+void expect_equal(const PersistentSet<int>& s, const std::set<int>& expected) {
+    ASSERT_EQ(s.size(), expected.size());
+    auto jt = expected.begin();
+    for (int key : s) {
+        ASSERT_EQ(key, *jt++);
+    }
+    ASSERT_EQ(jt, expected.end());
+}
+
+TEST(PersistentSetTest, MatchesStdSet) {
+    PersistentSet<int> s;
+    std::set<int> expected;
+    std::mt19937 gen(11);
+    for (int i = 0; i < 50000; ++i) {
+        int key = static_cast<int>(gen() % 3000);
+        switch (gen() % 3) {
+            case 0:
+                ASSERT_EQ(s.insert(key), expected.insert(key).second);
+                break;
+            case 1:
+                s.erase(key);
+                expected.erase(key);
+                break;
+            default: {
+                ASSERT_EQ(s.contains(key), expected.count(key) == 1);
+                auto it = s.lower_bound(key);
+                auto jt = expected.lower_bound(key);
+                ASSERT_EQ(it == s.end(), jt == expected.end());
+                if (jt != expected.end()) {
+                    ASSERT_EQ(*it, *jt);
+                }
+                break;
+            }
+        }
+    }
+    expect_equal(s, expected);
+}
+
+TEST(PersistentSetTest, SnapshotsDontChange) {
+    PersistentSet<int> s;
+    std::set<int> expected;
+    std::vector<std::pair<PersistentSet<int>, std::set<int>>> snapshots;
+    std::mt19937 gen(5);
+    for (int i = 0; i < 20000; ++i) {
+        int key = static_cast<int>(gen() % 2000);
+        if (gen() % 3 == 0) {
+            s.erase(key);
+            expected.erase(key);
+        } else {
+            s.insert(key);
+            expected.insert(key);
+        }
+        if (i % 1000 == 0) {
+            snapshots.emplace_back(s.snapshot(), expected);
+        }
+    }
+    expect_equal(s, expected);
+    for (const auto& [snapshot, keys] : snapshots) {
+        expect_equal(snapshot, keys);
+    }
+    // Changing a snapshot doesn't touch the set it came from.
+    PersistentSet<int> copy = s;
+    copy.insert(-1);
+    EXPECT_FALSE(s.contains(-1));
+    PersistentSet<int> moved(std::move(copy));
+    EXPECT_TRUE(moved.contains(-1));
+    EXPECT_TRUE(copy.empty());
+    copy.insert(3);
+    EXPECT_EQ(copy.size(), 1u);
+}
+
+}  // namespace
@@ -0,0 +1,561 @@
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "tree.h"
+
+namespace {
+
+struct WidePolicy : FanoutPolicy<8, 16> {
+    static constexpr bool order_statistics = true;
+};
+
+// Parallel build, copy and destruction start at a few times PARALLEL_GRAIN
+// elements.
+struct FourThreadsPolicy : SetPolicy {
+    static constexpr size_t parallel_threads = 4;
+};
+
+template<class S, bool OrderStatistics = false>
+struct Config {
+    using Set = S;
+    static constexpr bool order_statistics = OrderStatistics;
+};
+
+using Configs = ::testing::Types<
+    Config<Set<int>>,
+    Config<Set<int, std::less<int>, std::allocator<int>,
+               OrderStatisticsPolicy>,
+           true>,
+    Config<BasicSet<int, 3, 5>>,
+    Config<Set<int, std::less<int>, std::allocator<int>, WidePolicy>, true>,
+    Config<Set<int, std::less<int>, PoolAllocator<int>>>,
+    Config<Set<int, std::less<int>, PoolAllocator<int>, FourThreadsPolicy>>,
+    Config<Set<int, std::less<int>, std::allocator<int>, ParallelPolicy>>,
+    Config<Set<int, std::less<int>, std::allocator<int>, CountersPolicy>>>;
+
+template<class C>
+class SetTest : public ::testing::Test {
+  protected:
+    using S = typename C::Set;
+
+    // Checks that s holds exactly the keys of expected, walking it both
+    // ways.
+    static void expect_equal(const S& s, const std::set<int>& expected) {
+        ASSERT_EQ(s.size(), expected.size());
+        ASSERT_EQ(s.empty(), expected.empty());
+        ASSERT_TRUE(std::equal(s.begin(), s.end(), expected.begin(),
+                               expected.end()));
+        std::vector<int> backward;
+        for (auto it = s.end(); it != s.begin();) {
+            backward.push_back(*--it);
+        }
+        ASSERT_TRUE(std::equal(backward.begin(), backward.end(),
+                               expected.rbegin(), expected.rend()));
+        ASSERT_EQ(s.stats().leaves, expected.size());
+    }
+
+    // Returns n random keys in [0, range), with repeats.
+    std::vector<int> random_keys(size_t n, int range) {
+        std::uniform_int_distribution<int> dist(0, range - 1);
+        std::vector<int> keys;
+        for (size_t i = 0; i < n; ++i) {
+            keys.push_back(dist(gen_));
+        }
+        return keys;
+    }
+
+    int random(int lo, int hi) {
+        return std::uniform_int_distribution<int>(lo, hi)(gen_);
+    }
+
+    std::mt19937 gen_{12345};
+};
+
+TYPED_TEST_SUITE(SetTest, Configs);
+
+TYPED_TEST(SetTest, RandomOperations) {
+    typename TestFixture::S s;
+    std::set<int> expected;
+    for (int i = 0; i < 50000; ++i) {
+        int key = this->random(0, 2000);
+        switch (this->random(0, 4)) {
+            case 0: {
+                auto res = s.insert(key);
+                ASSERT_EQ(res.second, expected.insert(key).second);
+                ASSERT_EQ(*res.first, key);
+                break;
+            }
+            case 1:
+                s.erase(key);
+                expected.erase(key);
+                break;
+            case 2: {
+                auto it = s.lower_bound(key);
+                auto jt = expected.lower_bound(key);
+                ASSERT_EQ(it == s.end(), jt == expected.end());
+                if (jt != expected.end()) {
+                    ASSERT_EQ(*it, *jt);
+                }
+                break;
+            }
+            case 3:
+                ASSERT_EQ(s.contains(key), expected.count(key) == 1);
+                ASSERT_EQ(s.find(key) != s.end(), expected.count(key) == 1);
+                break;
+            default: {
+                auto it = s.find(key);
+                if (it != s.end()) {
+                    auto next = s.erase(it);
+                    auto jt = expected.erase(expected.find(key));
+                    ASSERT_EQ(next == s.end(), jt == expected.end());
+                    if (jt != expected.end()) {
+                        ASSERT_EQ(*next, *jt);
+                    }
+                }
+                break;
+            }
+        }
+        ASSERT_EQ(s.size(), expected.size());
+    }
+    this->expect_equal(s, expected);
+}
+
+TYPED_TEST(SetTest, EmplaceHint) {
+    typename TestFixture::S s;
+    std::set<int> expected;
+    for (int i = 0; i < 3000; ++i) {
+        s.emplace_hint(s.end(), i * 2);
+        expected.insert(i * 2);
+    }
+    for (int key : this->random_keys(3000, 7000)) {
+        auto it = s.emplace_hint(s.lower_bound(key), key);
+        ASSERT_EQ(*it, key);
+        expected.insert(key);
+    }
+    this->expect_equal(s, expected);
+}
+
+TYPED_TEST(SetTest, RangeErase) {
+    std::vector<int> keys = this->random_keys(20000, 100000);
+    typename TestFixture::S s(keys.begin(), keys.end());
+    std::set<int> expected(keys.begin(), keys.end());
+    while (!expected.empty()) {
+        // Both short ranges and long ones, which are cut out by split and
+        // join.
+        int lo = this->random(0, 100000);
+        int hi = lo + this->random(0, 1) * this->random(0, 100000) +
+                 this->random(0, 20);
+        auto last = s.erase(s.lower_bound(lo), s.lower_bound(hi));
+        expected.erase(expected.lower_bound(lo), expected.lower_bound(hi));
+        auto jt = expected.lower_bound(hi);
+        ASSERT_EQ(last == s.end(), jt == expected.end());
+        this->expect_equal(s, expected);
+    }
+    EXPECT_EQ(s.erase(s.begin(), s.end()), s.end());
+}
+
+TYPED_TEST(SetTest, SplitAndJoin) {
+    using S = typename TestFixture::S;
+    std::vector<int> keys = this->random_keys(10000, 50000);
+    std::set<int> expected(keys.begin(), keys.end());
+    S s(keys.begin(), keys.end());
+    for (int round = 0; round < 30; ++round) {
+        int key = this->random(-10, 50010);
+        auto [left, right] = s.split(key);
+        EXPECT_TRUE(s.empty());
+        this->expect_equal(left, {expected.begin(), expected.lower_bound(key)});
+        this->expect_equal(right, {expected.lower_bound(key), expected.end()});
+        s = S::join(std::move(left), std::move(right));
+        this->expect_equal(s, expected);
+    }
+}
+
+TYPED_TEST(SetTest, JoinWithOtherAllocator) {
+    using S = typename TestFixture::S;
+    std::set<int> expected;
+    S left;
+    for (int i = 0; i < 1000; ++i) {
+        left.insert(i);
+        expected.insert(i);
+    }
+    {
+        // A set constructed on its own has its own arena with PoolAllocator.
+        S right;
+        for (int i = 1000; i < 5000; i += 3) {
+            right.insert(i);
+            expected.insert(i);
+        }
+        left = S::join(std::move(left), std::move(right));
+    }
+    this->expect_equal(left, expected);
+}
+
+TYPED_TEST(SetTest, SortedBulkOperations) {
+    using S = typename TestFixture::S;
+    std::vector<int> keys = this->random_keys(30000, 60000);
+    std::sort(keys.begin(), keys.end());
+    std::set<int> expected(keys.begin(), keys.end());
+
+    // Equal keys are skipped by sorted builds.
+    this->expect_equal(S(assume_sorted, keys.begin(), keys.end()), expected);
+    this->expect_equal(S::from_sorted(keys.begin(), keys.end()), expected);
+    this->expect_equal(S(keys.begin(), keys.end()), expected);
+    std::vector<int> shuffled = keys;
+    std::shuffle(shuffled.begin(), shuffled.end(), this->gen_);
+    this->expect_equal(S(shuffled.begin(), shuffled.end()), expected);
+
+    S s(keys.begin(), keys.end());
+    // A few keys are found by fingers, many rebuild the tree.
+    for (size_t count : {size_t(10), size_t(500), size_t(40000)}) {
+        std::vector<int> more = this->random_keys(count, 120000);
+        std::sort(more.begin(), more.end());
+        size_t inserted = 0;
+        for (int key : more) {
+            inserted += expected.insert(key).second;
+        }
+        ASSERT_EQ(s.insert_sorted(more.begin(), more.end()), inserted);
+        this->expect_equal(s, expected);
+
+        std::vector<int> less = this->random_keys(count, 120000);
+        std::sort(less.begin(), less.end());
+        size_t erased = 0;
+        for (int key : less) {
+            erased += expected.erase(key);
+        }
+        ASSERT_EQ(s.erase_sorted(less.begin(), less.end()), erased);
+        this->expect_equal(s, expected);
+    }
+}
+
+TYPED_TEST(SetTest, SetOperations) {
+    using S = typename TestFixture::S;
+    for (int round = 0; round < 10; ++round) {
+        int range = this->random(10, 40000);
+        std::vector<int> a_keys = this->random_keys(this->random(0, 20000),
+                                                    range);
+        std::vector<int> b_keys = this->random_keys(this->random(0, 5000),
+                                                    range);
+        // Disjoint ranges are joined by the moving union.
+        if (round % 3 == 0) {
+            for (int& key : b_keys) {
+                key += range;
+            }
+        }
+        std::set<int> a_set(a_keys.begin(), a_keys.end());
+        std::set<int> b_set(b_keys.begin(), b_keys.end());
+        S a(a_keys.begin(), a_keys.end());
+        S b(b_keys.begin(), b_keys.end());
+
+        std::set<int> expected;
+        std::set_union(a_set.begin(), a_set.end(), b_set.begin(), b_set.end(),
+                       std::inserter(expected, expected.end()));
+        this->expect_equal(S::set_union(a, b), expected);
+        this->expect_equal(S::set_union(S(a), S(b)), expected);
+        this->expect_equal(S::set_union(S(b), S(a)), expected);
+
+        expected.clear();
+        std::set_intersection(a_set.begin(), a_set.end(), b_set.begin(),
+                              b_set.end(),
+                              std::inserter(expected, expected.end()));
+        this->expect_equal(S::set_intersection(a, b), expected);
+        this->expect_equal(S::set_intersection(b, a), expected);
+
+        expected.clear();
+        std::set_difference(a_set.begin(), a_set.end(), b_set.begin(),
+                            b_set.end(),
+                            std::inserter(expected, expected.end()));
+        this->expect_equal(S::set_difference(a, b), expected);
+        this->expect_equal(S::set_difference(S(a), b), expected);
+
+        this->expect_equal(a, a_set);
+        this->expect_equal(b, b_set);
+    }
+}
+
+TYPED_TEST(SetTest, NodeHandles) {
+    using S = typename TestFixture::S;
+    std::set<int> expected;
+    S s;
+    for (int i = 0; i < 2000; ++i) {
+        s.insert(i);
+        expected.insert(i);
+    }
+    EXPECT_TRUE(s.extract(5000).empty());
+    {
+        S other({100, 5000, 5001}, s.get_allocator());
+        auto res = s.insert(other.extract(5000));
+        EXPECT_TRUE(res.inserted);
+        EXPECT_TRUE(res.node.empty());
+        EXPECT_EQ(*res.position, 5000);
+        expected.insert(5000);
+
+        res = s.insert(other.extract(100));
+        EXPECT_FALSE(res.inserted);
+        ASSERT_FALSE(res.node.empty());
+        EXPECT_EQ(res.node.value(), 100);
+        EXPECT_EQ(*res.position, 100);
+
+        auto node = s.extract(s.find(7));
+        node.value() = -7;
+        expected.erase(7);
+        s.insert(std::move(node));
+        expected.insert(-7);
+        EXPECT_EQ(other.size(), 1u);
+    }
+    this->expect_equal(s, expected);
+
+    {
+        S other(s.get_allocator());
+        for (int i = 1500; i < 3000; ++i) {
+            other.insert(i);
+        }
+        s.merge(other);
+        for (int i = 1500; i < 3000; ++i) {
+            expected.insert(i);
+        }
+        // Keys already in s stay in other.
+        EXPECT_EQ(other.size(), 500u);
+        EXPECT_EQ(*other.begin(), 1500);
+    }
+    this->expect_equal(s, expected);
+
+    // A copy shares the allocator, so leaves are relinked.
+    S copy(s);
+    S empty(s.get_allocator());
+    empty.merge(copy);
+    EXPECT_TRUE(copy.empty());
+    this->expect_equal(empty, expected);
+}
+
+// Sets made on their own have different arenas with PoolAllocator, so
+// elements are moved into new leaves.
+TYPED_TEST(SetTest, NodeHandlesAcrossArenas) {
+    using S = typename TestFixture::S;
+    std::set<int> expected;
+    S s;
+    for (int i = 0; i < 2000; ++i) {
+        s.insert(i);
+        expected.insert(i);
+    }
+    {
+        S other{100, 5000, 5001};
+        auto res = s.insert(other.extract(5000));
+        EXPECT_TRUE(res.inserted);
+        EXPECT_EQ(*res.position, 5000);
+        expected.insert(5000);
+
+        res = s.insert(other.extract(100));
+        EXPECT_FALSE(res.inserted);
+        ASSERT_FALSE(res.node.empty());
+        EXPECT_EQ(res.node.value(), 100);
+        EXPECT_EQ(other.size(), 1u);
+    }
+    this->expect_equal(s, expected);
+
+    {
+        S other;
+        for (int i = 1500; i < 3000; ++i) {
+            other.insert(i);
+        }
+        s.merge(other);
+        for (int i = 1500; i < 3000; ++i) {
+            expected.insert(i);
+        }
+        EXPECT_EQ(other.size(), 500u);
+        EXPECT_EQ(*other.begin(), 1500);
+    }
+    this->expect_equal(s, expected);
+
+    S empty;
+    empty.merge(s);
+    EXPECT_TRUE(s.empty());
+    this->expect_equal(empty, expected);
+}
+
+TYPED_TEST(SetTest, OrderStatistics) {
+    if constexpr (TypeParam::order_statistics) {
+        std::vector<int> keys = this->random_keys(20000, 100000);
+        typename TestFixture::S s(keys.begin(), keys.end());
+        std::set<int> expected(keys.begin(), keys.end());
+        for (int i = 0; i < 2000; ++i) {
+            int key = this->random(0, 100000);
+            if (i % 2 == 0) {
+                s.insert(key);
+                expected.insert(key);
+            } else {
+                s.erase(key);
+                expected.erase(key);
+            }
+        }
+        std::vector<int> sorted(expected.begin(), expected.end());
+        for (size_t k = 0; k < sorted.size(); k += 7) {
+            ASSERT_EQ(*s.nth(k), sorted[k]);
+        }
+        EXPECT_EQ(s.nth(sorted.size()), s.end());
+        for (int i = 0; i < 2000; ++i) {
+            int lo = this->random(-10, 100010);
+            int hi = lo + this->random(0, 30000);
+            size_t rank = std::lower_bound(sorted.begin(), sorted.end(), lo) -
+                          sorted.begin();
+            ASSERT_EQ(s.rank(lo), rank);
+            size_t count =
+                std::lower_bound(sorted.begin(), sorted.end(), hi) -
+                sorted.begin() - rank;
+            ASSERT_EQ(s.count_range(lo, hi), count);
+        }
+    }
+}
+
+TYPED_TEST(SetTest, RangeScansAndBatches) {
+    std::vector<int> keys = this->random_keys(20000, 100000);
+    typename TestFixture::S s(keys.begin(), keys.end());
+    std::set<int> expected(keys.begin(), keys.end());
+    for (int i = 0; i < 200; ++i) {
+        int lo = this->random(0, 100000);
+        int hi = lo + this->random(0, 5000);
+        std::vector<int> want(expected.lower_bound(lo),
+                              expected.lower_bound(hi));
+        std::vector<int> got;
+        s.for_each_range(lo, hi, [&got](int key) { got.push_back(key); });
+        ASSERT_EQ(got, want);
+        got.clear();
+        s.copy_range(lo, hi, std::back_inserter(got));
+        ASSERT_EQ(got, want);
+    }
+
+    std::vector<int> queries = this->random_keys(1000, 100000);
+    std::vector<typename TestFixture::S::Iterator> found;
+    s.find_batch(queries.begin(), queries.end(), std::back_inserter(found));
+    std::vector<bool> contained;
+    s.contains_batch(queries.begin(), queries.end(),
+                     std::back_inserter(contained));
+    ASSERT_EQ(found.size(), queries.size());
+    ASSERT_EQ(contained.size(), queries.size());
+    for (size_t i = 0; i < queries.size(); ++i) {
+        ASSERT_EQ(found[i], s.find(queries[i]));
+        ASSERT_EQ(contained[i], expected.count(queries[i]) == 1);
+    }
+    std::sort(queries.begin(), queries.end());
+    found.clear();
+    s.find_batch(queries.begin(), queries.end(), std::back_inserter(found));
+    for (size_t i = 0; i < queries.size(); ++i) {
+        ASSERT_EQ(found[i], s.find(queries[i]));
+    }
+}
+
+TYPED_TEST(SetTest, ParallelForEach) {
+    std::vector<int> keys(300000);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        keys[i] = static_cast<int>(i);
+    }
+    typename TestFixture::S s(keys.begin(), keys.end());
+    std::atomic<long long> sum{0};
+    std::atomic<size_t> count{0};
+    s.parallel_for_each(
+        [&](int key) {
+            sum.fetch_add(key, std::memory_order_relaxed);
+            count.fetch_add(1, std::memory_order_relaxed);
+        },
+        4);
+    EXPECT_EQ(count.load(), keys.size());
+    EXPECT_EQ(sum.load(), 1LL * keys.size() * (keys.size() - 1) / 2);
+}
+
+TYPED_TEST(SetTest, CopyAndMove) {
+    using S = typename TestFixture::S;
+    // Big enough for parallel build, copy and destruction.
+    std::vector<int> keys(300000);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        keys[i] = static_cast<int>(i * 3);
+    }
+    std::set<int> expected(keys.begin(), keys.end());
+    S s(keys.begin(), keys.end());
+    this->expect_equal(s, expected);
+
+    S copy(s);
+    this->expect_equal(copy, expected);
+    copy.insert(1);
+    EXPECT_FALSE(s.contains(1));
+
+    S assigned{1, 2};
+    assigned = s;
+    this->expect_equal(assigned, expected);
+
+    S moved(std::move(copy));
+    EXPECT_TRUE(copy.empty());
+    EXPECT_TRUE(moved.contains(1));
+    // A moved-from set still works.
+    copy.insert(42);
+    EXPECT_EQ(copy.size(), 1u);
+    EXPECT_EQ(*copy.begin(), 42);
+
+    assigned = std::move(moved);
+    EXPECT_EQ(assigned.size(), expected.size() + 1);
+}
+
+TEST(SetStringTest, MatchesStdSet) {
+    std::mt19937 gen(7);
+    Set<std::string, std::less<std::string>, PoolAllocator<std::string>> s;
+    std::set<std::string> expected;
+    for (int i = 0; i < 20000; ++i) {
+        std::string key = "key" + std::to_string(gen() % 3000);
+        if (gen() % 3 == 0) {
+            s.erase(key);
+            expected.erase(key);
+        } else {
+            ASSERT_EQ(s.insert(key).second, expected.insert(key).second);
+        }
+    }
+    ASSERT_EQ(s.size(), expected.size());
+    EXPECT_TRUE(std::equal(s.begin(), s.end(), expected.begin(),
+                           expected.end()));
+    auto [left, right] = s.split("key2");
+    EXPECT_EQ(left.size() + right.size(), expected.size());
+}
+
+TEST(SetCountersTest, CountsWork) {
+    Set<int, std::less<int>, std::allocator<int>, CountersPolicy> s;
+    for (int i = 0; i < 1000; ++i) {
+        s.insert(i);
+    }
+    SetCounters counters = s.counters();
+    EXPECT_GT(counters.comparisons, 0u);
+    EXPECT_GT(counters.splits, 0u);
+    EXPECT_EQ(counters.allocations - counters.deallocations,
+              s.stats().leaves + s.stats().inner_nodes);
+    // A copy counts only its own work.
+    auto copy = s;
+    EXPECT_EQ(copy.counters().comparisons, 0u);
+    EXPECT_EQ(copy.counters().allocations,
+              copy.stats().leaves + copy.stats().inner_nodes);
+    s.reset_counters();
+    EXPECT_EQ(s.counters().comparisons, 0u);
+}
+
+// Appending with a right hint doesn't descend, so it makes a bounded number
+// of comparisons per element, unlike insert.
+TEST(SetCountersTest, RightHintsSkipDescent) {
+    constexpr int N = 100000;
+    Set<int, std::less<int>, std::allocator<int>, CountersPolicy> s;
+    for (int i = 0; i < N; ++i) {
+        s.emplace_hint(s.end(), i);
+    }
+    SetCounters counters = s.counters();
+    EXPECT_LE(counters.comparisons, 2u * N);
+    EXPECT_EQ(counters.node_visits, 0u);
+
+    Set<int, std::less<int>, std::allocator<int>, CountersPolicy> t;
+    for (int i = 0; i < N; ++i) {
+        t.insert(i);
+    }
+    EXPECT_GT(t.counters().comparisons, 4u * N);
+}
+
+}  // namespace
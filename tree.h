@@ -1,46 +1,496 @@
+#pragma once
+
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <exception>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
 #include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+/**
+ *  Storage shared by all copies of a PoolAllocator. Objects are carved out of
+ *  big chunks, one slab per (size, alignment) class, and freed slots are kept
+ *  in an intrusive free list. Chunks are returned to the system only when the
+ *  arena is destroyed, which takes O(number of chunks).
+ *
+ */
+
+class NodeArena {
+  public:
+    // Slab of equally sized slots.
+    struct Slab {
+        void* allocate();
+
+        void deallocate(void* ptr);
+
+        size_t slot_size = 0;
+        size_t align = 0;
+        size_t chunk_slots = 0;
+        char* next = nullptr;
+        char* end = nullptr;
+        void* free_list = nullptr;
+        std::vector<void*> chunks;
+    };
+
+    explicit NodeArena(size_t chunk_slots) : chunk_slots_(chunk_slots) {}
+
+    NodeArena(const NodeArena&) = delete;
+
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    ~NodeArena();
+
+    // Returns slab for objects of given size and alignment. Time: O(classes).
+    Slab* slab(size_t size, size_t align);
+
+  private:
+    size_t chunk_slots_;
+    std::vector<std::unique_ptr<Slab>> slabs_;
+};
+
+inline void* NodeArena::Slab::allocate() {
+    if (free_list != nullptr) {
+        void* ptr = free_list;
+        free_list = *static_cast<void**>(ptr);
+        return ptr;
+    }
+    if (next == end) {
+        char* chunk = static_cast<char*>(::operator new(
+            slot_size * chunk_slots, std::align_val_t(align)));
+        chunks.push_back(chunk);
+        next = chunk;
+        end = chunk + slot_size * chunk_slots;
+    }
+    void* ptr = next;
+    next += slot_size;
+    return ptr;
+}
+
+inline void NodeArena::Slab::deallocate(void* ptr) {
+    *static_cast<void**>(ptr) = free_list;
+    free_list = ptr;
+}
+
+inline NodeArena::~NodeArena() {
+    for (const auto& slab : slabs_) {
+        for (void* chunk : slab->chunks) {
+            ::operator delete(chunk, std::align_val_t(slab->align));
+        }
+    }
+}
+
+inline NodeArena::Slab* NodeArena::slab(size_t size, size_t align) {
+    align = std::max(align, alignof(void*));
+    size = std::max(size, sizeof(void*));
+    size = (size + align - 1) / align * align;
+    for (const auto& slab : slabs_) {
+        if (slab->slot_size == size && slab->align == align) {
+            return slab.get();
+        }
+    }
+    slabs_.push_back(std::make_unique<Slab>());
+    slabs_.back()->slot_size = size;
+    slabs_.back()->align = align;
+    slabs_.back()->chunk_slots = chunk_slots_;
+    return slabs_.back().get();
+}
+
+/**
+ *  Allocator which hands out single objects from a NodeArena. Copies and
+ *  rebinds of an allocator share the same arena, so every node of a Set (and
+ *  of its copies) lives in a few contiguous chunks. Arrays are allocated with
+ *  operator new. Allocators sharing an arena must not be used by several
+ *  threads at once.
+ *
+ *  @tparam T           Type of allocated objects.
+ *  @tparam CHUNK_SLOTS Number of objects in one chunk.
+ *
+ */
+
+template<class T, size_t CHUNK_SLOTS = 1024>
+class PoolAllocator {
+  public:
+    using value_type = T;
+
+    template<class U>
+    struct rebind {
+        using other = PoolAllocator<U, CHUNK_SLOTS>;
+    };
+
+    PoolAllocator()
+        : arena_(std::make_shared<NodeArena>(CHUNK_SLOTS)),
+          slab_(arena_->slab(sizeof(T), alignof(T))) {}
+
+    // May allocate the slab for T in the shared arena.
+    template<class U>
+    PoolAllocator(const PoolAllocator<U, CHUNK_SLOTS>& other)
+        : arena_(other.arena_), slab_(arena_->slab(sizeof(T), alignof(T))) {}
+
+    // Time: O(1).
+    T* allocate(size_t n);
+
+    // Time: O(1).
+    void deallocate(T* ptr, size_t n);
+
+    // Returns number of allocators sharing the arena. Time: O(1).
+    long arena_use_count() const noexcept { return arena_.use_count(); }
+
+    template<class U>
+    bool operator==(const PoolAllocator<U, CHUNK_SLOTS>& other) const {
+        return arena_ == other.arena_;
+    }
+
+    template<class U>
+    bool operator!=(const PoolAllocator<U, CHUNK_SLOTS>& other) const {
+        return arena_ != other.arena_;
+    }
+
+  private:
+    template<class U, size_t>
+    friend class PoolAllocator;
+
+    std::shared_ptr<NodeArena> arena_;
+    NodeArena::Slab* slab_;
+};
+
+template<class T, size_t CHUNK_SLOTS>
+T* PoolAllocator<T, CHUNK_SLOTS>::allocate(size_t n) {
+    if (n != 1) {
+        return static_cast<T*>(
+            ::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+    }
+    return static_cast<T*>(slab_->allocate());
+}
+
+template<class T, size_t CHUNK_SLOTS>
+void PoolAllocator<T, CHUNK_SLOTS>::deallocate(T* ptr, size_t n) {
+    if (n != 1) {
+        ::operator delete(ptr, std::align_val_t(alignof(T)));
+        return;
+    }
+    slab_->deallocate(ptr);
+}
+
+template<class A>
+struct is_pool_allocator : std::false_type {};
+
+template<class T, size_t CHUNK_SLOTS>
+struct is_pool_allocator<PoolAllocator<T, CHUNK_SLOTS>> : std::true_type {};
+
+// Set iterators throw std::out_of_range when used after the set was modified.
+// The check costs a load and a branch per operation, so by default it's done
+// only in debug builds. Define SET_CHECK_ITERATORS to 0 or 1 to override.
+#ifndef SET_CHECK_ITERATORS
+#ifdef NDEBUG
+#define SET_CHECK_ITERATORS 0
+#else
+#define SET_CHECK_ITERATORS 1
+#endif
+#endif
+
+// Takes the key out of an element of Set, which is the element itself.
+struct KeyIdentity {
+    template<class T>
+    static const T& key(const T& val) {
+        return val;
+    }
+};
+
+// Takes the key out of a key-value pair, used by Map.
+struct KeyFirst {
+    template<class T>
+    static const auto& key(const T& val) {
+        return val.first;
+    }
+};
+
+// Default options of Set. Derive from it to override some of them.
+struct SetPolicy {
+    // Keep subtree sizes in inner nodes, so that nth, rank and count_range
+    // work in O(log(n)). Costs a size_t per son of every inner node.
+    static constexpr bool order_statistics = false;
+
+    // Max number of threads building, copying and destroying big sets, 0
+    // means std::thread::hardware_concurrency(). Nodes are then allocated
+    // and freed by many threads at once, so the allocator must be thread
+    // safe. PoolAllocator is not, so sets using it do all of this on one
+    // thread whatever the policy says.
+    static constexpr size_t parallel_threads = 1;
+
+    // Bounds of the number of sons of internal nodes other than the root,
+    // which has at least 2. max_sons must be at least 2 * min_sons - 1. The
+    // default is a 2-3 tree, wider nodes make the tree lower, so lookups
+    // touch fewer cache lines.
+    static constexpr size_t min_sons = 2;
+    static constexpr size_t max_sons = 3;
+
+    // Count comparisons, node visits, splits, merges and allocations, see
+    // Set::counters. Counters are atomic, because parallel bulk operations
+    // update them from many threads.
+    static constexpr bool counters = false;
+
+    // Takes keys out of elements, like KeyIdentity. Internal nodes keep only
+    // keys and the comparator compares keys.
+    using key_of = KeyIdentity;
+};
+
+struct OrderStatisticsPolicy : SetPolicy {
+    static constexpr bool order_statistics = true;
+};
+
+// B-tree with MinSons to MaxSons sons per internal node.
+template<size_t MinSons, size_t MaxSons>
+struct FanoutPolicy : SetPolicy {
+    static constexpr size_t min_sons = MinSons;
+    static constexpr size_t max_sons = MaxSons;
+};
+
+struct ParallelPolicy : SetPolicy {
+    static constexpr size_t parallel_threads = 0;
+};
+
+struct CountersPolicy : SetPolicy {
+    static constexpr bool counters = true;
+};
+
+// Work done by a Set since it was made or its counters were reset.
+struct SetCounters {
+    uint64_t comparisons = 0;
+    // Internal nodes searched for a son.
+    uint64_t node_visits = 0;
+    uint64_t splits = 0;
+    uint64_t merges = 0;
+    uint64_t borrows = 0;
+    // Leaves and internal nodes.
+    uint64_t allocations = 0;
+    uint64_t deallocations = 0;
+};
+
+// Shape of a Set, see Set::stats.
+struct SetStats {
+    size_t height = 0;
+    size_t leaves = 0;
+    size_t inner_nodes = 0;
+    // Number of internal nodes with i sons at i.
+    std::vector<size_t> sons_counts;
+    // Memory of nodes and the set object.
+    size_t bytes = 0;
+    // Average number of sons of internal nodes divided by max_sons.
+    double fill = 0;
+};
+
+// Counters of Set operations, kept with counters in the policy. Every set
+// counts its own work, so copies start from zero.
+template<bool Enabled>
+struct CounterHolder {};
+
+template<>
+struct CounterHolder<true> {
+    enum Counter {
+        COMPARISONS,
+        NODE_VISITS,
+        SPLITS,
+        MERGES,
+        BORROWS,
+        ALLOCATIONS,
+        DEALLOCATIONS,
+        COUNTERS_SIZE
+    };
+
+    CounterHolder() = default;
+
+    CounterHolder(const CounterHolder&) {}
+
+    CounterHolder& operator=(const CounterHolder&) { return *this; }
+
+    mutable std::array<std::atomic<uint64_t>, COUNTERS_SIZE> counts{};
+};
+
+// Sizes of sons' subtrees, kept in inner nodes with order statistics.
+template<size_t N, bool Enabled>
+struct SubtreeSizes {};
+
+template<size_t N>
+struct SubtreeSizes<N, true> {
+    std::array<size_t, N> sizes;
+};
+
+// Stores comparator of Set. Empty comparators take no space.
+template<class Compare,
+         bool = std::is_empty_v<Compare> && !std::is_final_v<Compare>>
+class CompareHolder {
+  public:
+    CompareHolder() = default;
+
+    explicit CompareHolder(const Compare& comp) : comp_(comp) {}
+
+    const Compare& comp() const { return comp_; }
+
+  private:
+    Compare comp_;
+};
+
+template<class Compare>
+class CompareHolder<Compare, true> : private Compare {
+  public:
+    CompareHolder() = default;
+
+    explicit CompareHolder(const Compare& comp) : Compare(comp) {}
+
+    const Compare& comp() const { return *this; }
+};
+
+template<class K, class V, class Compare, class Allocator, class Policy>
+class Map;
+
+// Tag telling Set that input range is sorted in ascending order.
+struct assume_sorted_t {
+    explicit assume_sorted_t() = default;
+};
+
+inline constexpr assume_sorted_t assume_sorted{};
+
 /**
  *  A sorted associative container made up of unique keys, which can be
- *  retrieved in logarithmic time. It's an implementation of 2-3 tree.
+ *  retrieved in logarithmic time. It's an implementation of B+ tree with
+ *  fanout set by Policy, which is 2-3 tree by default.
  *
- *  @tparam T  Type of key objects.
+ *  @tparam T          Type of key objects.
+ *  @tparam Compare    Strict weak ordering of keys. If it has is_transparent,
+ *                     lookups accept any type comparable with keys.
+ *  @tparam Allocator  Allocator of keys, rebound for tree nodes. Use
+ *                     PoolAllocator to keep nodes in contiguous chunks.
+ *  @tparam Policy     Optional features, see SetPolicy.
  *
  */
 
-template<class T>
-class Set {
+template<class T, class Compare = std::less<T>,
+         class Allocator = std::allocator<T>, class Policy = SetPolicy>
+class Set : private CompareHolder<Compare>,
+            private CounterHolder<Policy::counters> {
+    static_assert(Policy::min_sons >= 2 &&
+                      Policy::max_sons >= 2 * Policy::min_sons - 1,
+                  "max_sons must be at least 2 * min_sons - 1");
+
+    template<class, class, class, class, class>
+    friend class Map;
+
   private:
-    static constexpr size_t MAX_SONS = 4;
+    // Type of keys kept in internal nodes.
+    using Key = std::remove_cv_t<std::remove_reference_t<decltype(
+        Policy::key_of::key(std::declval<const T&>()))>>;
+
+    static constexpr size_t MIN_SONS = Policy::min_sons;
+
+    // Capacity of internal nodes, which have one son too many before split.
+    static constexpr size_t MAX_SONS = Policy::max_sons + 1;
+
+    // Wide internal nodes start at cache line boundaries.
+    static constexpr size_t INNER_ALIGN =
+        std::max({MAX_SONS > 4 ? size_t(64) : size_t(1), alignof(Key),
+                  alignof(void*)});
+
+    // Every internal node has at least 2 sons, so no tree that fits in
+    // memory is higher.
+    static constexpr size_t MAX_HEIGHT = 64;
+
+    // Number of keys descended together by find_batch.
+    static constexpr size_t BATCH_SIZE = 16;
+
+    // Sorted runs at least size() / BULK_FACTOR long are merged by
+    // rebuilding the tree instead of inserting keys one by one.
+    static constexpr size_t BULK_FACTOR = 8;
 
+    // Least number of elements worth handing over to another thread.
+    static constexpr size_t PARALLEL_GRAIN = size_t(1) << 15;
+
+    // Max number of threads allocating and freeing nodes at once. Arenas of
+    // PoolAllocator aren't thread safe.
+    static constexpr size_t ALLOC_THREADS =
+        is_pool_allocator<Allocator>::value ? 1 : Policy::parallel_threads;
+
+    struct Inner;
+
+    // Leaves have no sons.
     struct Node {
-        Node() = default;
+        Inner* parent = nullptr;
+        size_t sons_size = 0;
+        // Position among sons of parent.
+        size_t index = 0;
+    };
+
+    // Leaves are threaded into a circular list through END_NODE_.
+    struct Link : Node {
+        Link* prev = this;
+        Link* next = this;
+    };
 
-        explicit Node(const T& val) : val(new T(val)) {}
+    struct Leaf : Link {
+        template<class... Args>
+        explicit Leaf(Args&&... args) : val(std::forward<Args>(args)...) {}
+
+        T val;
+    };
+
+    // Keeps copy of the max key of every son next to sons, so descent reads
+    // one node per level. Keys [0, sons_size) are constructed.
+    struct alignas(INNER_ALIGN) Inner
+        : Node, SubtreeSizes<MAX_SONS, Policy::order_statistics> {
+        Key& key(size_t i) {
+            return *std::launder(reinterpret_cast<Key*>(&keys[i]));
+        }
+
+        const Key& key(size_t i) const {
+            return *std::launder(reinterpret_cast<const Key*>(&keys[i]));
+        }
 
-        T* val = nullptr;
-        Node* parent = nullptr;
         std::array<Node*, MAX_SONS> sons;
-        size_t sons_size = 0;
+        std::array<std::aligned_storage_t<sizeof(Key), alignof(Key)>,
+                   MAX_SONS>
+            keys;
     };
 
+    using KeyTraits = std::allocator_traits<Allocator>;
+    using LeafAllocator = typename KeyTraits::template rebind_alloc<Leaf>;
+    using InnerAllocator = typename KeyTraits::template rebind_alloc<Inner>;
+    using LeafTraits = std::allocator_traits<LeafAllocator>;
+    using InnerTraits = std::allocator_traits<InnerAllocator>;
+
   public:
-    class Iterator : public std::iterator<std::bidirectional_iterator_tag, T> {
+    class Iterator {
+      public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
       private:
-        // Check if Iterator is invalid O(1).
+        friend class Set<T, Compare, Allocator, Policy>;
+
+        // Check if Iterator is invalid O(1). Does nothing unless
+        // SET_CHECK_ITERATORS is set.
         void check_version_() const;
 
-        const Node* cur_ = nullptr;
-        const Set<T>* s_ = nullptr;
+        const Link* cur_ = nullptr;
+#if SET_CHECK_ITERATORS
+        const Set<T, Compare, Allocator, Policy>* s_ = nullptr;
         uint64_t version_ = 0;
+#endif
 
       public:
-        Iterator(const Node* node, const Set<T>* s);
+        Iterator(const Link* node, const Set<T, Compare, Allocator, Policy>* s);
 
         Iterator() = default;
         // Go to next element.
@@ -55,7 +505,7 @@ class Set {
         // Go to previous element.
         Iterator operator--(int);
 
-        T* operator->();
+        const T* operator->() const;
 
         bool operator!=(const Iterator& iter) const;
 
@@ -66,25 +516,103 @@ class Set {
 
     using iterator = Iterator;
 
+    /**
+     *  Owner of a leaf taken out of a set by extract. It can be inserted
+     *  into a set with an equal allocator without allocating or copying, and
+     *  into other sets by moving the element into a new leaf. A leaf that
+     *  isn't inserted is freed with the handle.
+     *
+     */
+
+    class NodeHandle {
+      public:
+        NodeHandle() = default;
+
+        NodeHandle(NodeHandle&& other) noexcept;
+
+        NodeHandle& operator=(NodeHandle&& other) noexcept;
+
+        ~NodeHandle();
+
+        bool empty() const { return leaf_ == nullptr; }
+
+        explicit operator bool() const { return leaf_ != nullptr; }
+
+        // Returns the key, which may be changed while it's not in a set.
+        T& value() const { return leaf_->val; }
+
+        Allocator get_allocator() const { return Allocator(*alloc_); }
+
+      private:
+        friend class Set<T, Compare, Allocator, Policy>;
+
+        NodeHandle(Leaf* leaf, const LeafAllocator& alloc)
+            : leaf_(leaf), alloc_(alloc) {}
+
+        // Frees the owned leaf, if any. Time: O(1).
+        void reset_();
+
+        Leaf* leaf_ = nullptr;
+        std::optional<LeafAllocator> alloc_;
+    };
+
+    using node_type = NodeHandle;
+
+    // Result of inserting a node handle. Node is empty if it was inserted,
+    // otherwise position is the element with the same key.
+    struct InsertReturn {
+        Iterator position;
+        bool inserted = false;
+        NodeHandle node;
+    };
+
+    using insert_return_type = InsertReturn;
+
   public:
     Set() = default;
 
-    // Create set with elements from [first, last) range.
+    explicit Set(const Compare& comp, const Allocator& alloc = Allocator());
+
+    explicit Set(const Allocator& alloc);
+
+    // Create set with elements from [first, last) range. Time: O(n) if range
+    // is sorted and isn't single-pass, O(n*log(n)) otherwise.
+    template<typename InputIterator>
+    Set(InputIterator first, InputIterator last,
+        const Compare& comp = Compare(), const Allocator& alloc = Allocator());
+
+    template<typename InputIterator>
+    Set(InputIterator first, InputIterator last, const Allocator& alloc);
+
+    // Create set with elements from sorted [first, last) range, equal
+    // elements are skipped. Time: O(n).
     template<typename InputIterator>
-    Set(InputIterator first, InputIterator last);
+    Set(assume_sorted_t, InputIterator first, InputIterator last,
+        const Compare& comp = Compare(), const Allocator& alloc = Allocator());
 
     // Create set with elements from elems.
-    Set(std::initializer_list<T> elems);
+    Set(std::initializer_list<T> elems, const Compare& comp = Compare(),
+        const Allocator& alloc = Allocator());
+
+    Set(std::initializer_list<T> elems, const Allocator& alloc);
+
+    // Returns set with elements from sorted [first, last) range. Time: O(n).
+    template<typename InputIterator>
+    static Set<T, Compare, Allocator, Policy> from_sorted(
+        InputIterator first, InputIterator last,
+        const Compare& comp = Compare(), const Allocator& alloc = Allocator());
 
-    Set(const Set<T>& s);
+    Set(const Set<T, Compare, Allocator, Policy>& s);
 
-    Set(Set<T>&& s) noexcept;
+    Set(Set<T, Compare, Allocator, Policy>&& s) noexcept;
 
     ~Set();
 
-    Set<T>& operator=(const Set<T>& s);
+    Set<T, Compare, Allocator, Policy>& operator=(
+        const Set<T, Compare, Allocator, Policy>& s);
 
-    Set<T>& operator=(Set<T>&& s) noexcept;
+    Set<T, Compare, Allocator, Policy>& operator=(
+        Set<T, Compare, Allocator, Policy>&& s) noexcept;
 
     // Return number of elements. Time: O(1).
     inline size_t size() const { return size_; }
@@ -92,13 +620,151 @@ class Set {
     // Checks whether the container is empty. Time: O(1).
     inline bool empty() const { return size_ == 0; }
 
+    // Returns the allocator associated with the set. Time: O(1).
+    inline Allocator get_allocator() const { return alloc_; }
+
+    // Returns the comparator of keys. Time: O(1).
+    inline Compare key_comp() const { return this->comp(); }
+
+    // Returns work done since the set was made or reset_counters was
+    // called. Needs counters. Time: O(1).
+    SetCounters counters() const;
+
+    // Sets all counters to zero. Needs counters. Time: O(1).
+    void reset_counters();
+
+    // Returns height, node counts, memory and fill of the tree. Time: O(n).
+    SetStats stats() const;
+
     // Inserts element into the set, if the set doesn't already contain an
-    // element with an equivalent key. Time: O(log(n)).
-    void insert(const T& elem);
+    // element with an equivalent key. Returns iterator to the element with
+    // the key and whether insertion took place. Time: O(log(n)).
+    std::pair<Iterator, bool> insert(const T& elem);
+
+    // Same as insert(const T&), but moves elem into the set.
+    // Time: O(log(n)).
+    std::pair<Iterator, bool> insert(T&& elem);
+
+    // Constructs element from args right in its leaf and inserts it, unless
+    // the set contains an equivalent key. Returns iterator to the element
+    // with the key and whether insertion took place. Time: O(log(n)).
+    template<class... Args>
+    std::pair<Iterator, bool> emplace(Args&&... args);
+
+    // Same as emplace, but the element is placed just before hint when this
+    // keeps the order, without descending from the root. Returns iterator to
+    // the element with the key. A right hint takes O(1) comparisons, but a
+    // new maximum of a node still updates the separator keys above it, and
+    // order statistics update sizes up to the root. Time: O(log(n)), with
+    // O(1) comparisons for a right hint.
+    template<class... Args>
+    Iterator emplace_hint(Iterator hint, Args&&... args);
+
+    // Inserts element owned by node, unless the set contains an equivalent
+    // key. If allocator of node is equal to the set's one, the leaf is
+    // relinked without allocations or copies, otherwise the element is moved
+    // into a new leaf and the old one is freed. Time: O(log(n)).
+    InsertReturn insert(NodeHandle&& node);
+
+    // Removes element equal to the given key from the set and returns the
+    // handle owning it, or an empty one. Time: O(log(n)).
+    NodeHandle extract(const T& elem);
+
+    // Removes element at pos from the set and returns the handle owning it.
+    // Time: O(log(n)).
+    NodeHandle extract(Iterator pos);
+
+    // Moves elements of source whose keys are not in the set by relinking
+    // their leaves, or into new leaves if allocators of the sets differ.
+    // Each key is searched from the leaf of the previous one.
+    // Time: O(m * log(n + m)), m is the size of source.
+    void merge(Set<T, Compare, Allocator, Policy>& source);
+
+    void merge(Set<T, Compare, Allocator, Policy>&& source);
 
     // Removes elem from the set, if the set contain it. Time: O(log(n)).
     void erase(const T& elem);
 
+    template<class K, class C = Compare, class = typename C::is_transparent>
+    void erase(const K& key);
+
+    // Removes element at pos and returns iterator to the next one. The leaf
+    // is unlinked directly, without searching. Time: O(log(n)).
+    Iterator erase(Iterator pos);
+
+    // Removes elements in [first, last) and returns last. Long ranges are cut
+    // out by two splits and a join, which drop whole subtrees at once and
+    // rebalance only along the boundary paths. If allocation of an internal
+    // node throws, the set is left empty. Time: O(log(n) + k), k is the
+    // number of removed elements.
+    Iterator erase(Iterator first, Iterator last);
+
+    // Inserts elements of sorted range [first, last) and returns the number
+    // of inserted ones. Each key is searched from the leaf of the previous
+    // one, and long runs rebuild the tree in one pass.
+    // Time: O(m * log(n / m)) for m keys, O(n + m) for long runs.
+    template<class InputIterator>
+    size_t insert_sorted(InputIterator first, InputIterator last);
+
+    // Removes elements of sorted range [first, last) and returns the number
+    // of removed ones, like insert_sorted.
+    // Time: O(m * log(n / m)) for m keys, O(n + m) for long runs.
+    template<class InputIterator>
+    size_t erase_sorted(InputIterator first, InputIterator last);
+
+    // Moves elements less than key to the first returned set and the rest to
+    // the second one, leaving this set empty. If allocation of an internal
+    // node throws, all three sets are left empty. Time: O(log(n)) with order
+    // statistics, otherwise O(log(n) + min(k, n - k)) to count the k elements
+    // of the first set.
+    std::pair<Set<T, Compare, Allocator, Policy>,
+              Set<T, Compare, Allocator, Policy>>
+    split(const T& key);
+
+    // Returns set with elements of both sets, leaving them empty. All
+    // elements of lhs must be less than all elements of rhs. The result uses
+    // comparator and allocator of lhs, and copies elements of rhs if the
+    // allocators are not equal. If allocation of an internal node throws,
+    // both sets are left empty. Time: O(log(n)).
+    static Set<T, Compare, Allocator, Policy> join(
+        Set<T, Compare, Allocator, Policy>&& lhs,
+        Set<T, Compare, Allocator, Policy>&& rhs);
+
+    // Returns set with elements of a or b. The result uses comparator and
+    // allocator of a and is bulk built. Time: O(n + m).
+    static Set<T, Compare, Allocator, Policy> set_union(
+        const Set<T, Compare, Allocator, Policy>& a,
+        const Set<T, Compare, Allocator, Policy>& b);
+
+    // Same as above, but reuses trees: sets with disjoint ranges are joined,
+    // otherwise the smaller one is inserted into the bigger one, whose
+    // comparator and allocator the result keeps. Both sets are left empty.
+    // Time: O(log(n)) for disjoint ranges, O(m * log(n / m + 1)) otherwise.
+    static Set<T, Compare, Allocator, Policy> set_union(
+        Set<T, Compare, Allocator, Policy>&& a,
+        Set<T, Compare, Allocator, Policy>&& b);
+
+    // Returns set with elements of both a and b. Runs without common
+    // elements are skipped by finger searches. The result uses comparator
+    // and allocator of a and is bulk built. Time: O(m * log(n / m + 1)).
+    static Set<T, Compare, Allocator, Policy> set_intersection(
+        const Set<T, Compare, Allocator, Policy>& a,
+        const Set<T, Compare, Allocator, Policy>& b);
+
+    // Returns set with elements of a not in b. Runs of b outside of a are
+    // skipped by finger searches. The result uses comparator and allocator
+    // of a and is bulk built. Time: O(|a| + |b| * log(|a| / |b| + 1)).
+    static Set<T, Compare, Allocator, Policy> set_difference(
+        const Set<T, Compare, Allocator, Policy>& a,
+        const Set<T, Compare, Allocator, Policy>& b);
+
+    // Same as above, but erases elements of b from the tree of a if b is
+    // not much bigger than a. a is left empty.
+    // Time: O(min(|b| * log(|a| / |b| + 1), |a| * log(|b| / |a| + 1))).
+    static Set<T, Compare, Allocator, Policy> set_difference(
+        Set<T, Compare, Allocator, Policy>&& a,
+        const Set<T, Compare, Allocator, Policy>& b);
+
     // Returns an iterator to the beginning. Time: O(1)
     Iterator begin() const;
 
@@ -109,456 +775,2656 @@ class Set {
     // Time: O(log(n))
     Iterator lower_bound(const T& elem) const;
 
+    template<class K, class C = Compare, class = typename C::is_transparent>
+    Iterator lower_bound(const K& key) const;
+
     // Returns an iterator to the element equal to the given key. Time: O(log(n))
     Iterator find(const T& elem) const;
 
+    template<class K, class C = Compare, class = typename C::is_transparent>
+    Iterator find(const K& key) const;
+
+    // Checks whether the set contains the given key. Time: O(log(n))
+    bool contains(const T& elem) const;
+
+    template<class K, class C = Compare, class = typename C::is_transparent>
+    bool contains(const K& key) const;
+
+    // Returns an iterator to the k-th smallest element, counting from 0, or
+    // end() if k >= size(). Needs order statistics. Time: O(log(n)).
+    Iterator nth(size_t k) const;
+
+    // Returns number of elements less than the given key. Needs order
+    // statistics. Time: O(log(n)).
+    size_t rank(const T& elem) const;
+
+    // Returns number of elements in [lo, hi). Needs order statistics.
+    // Time: O(log(n)).
+    size_t count_range(const T& lo, const T& hi) const;
+
+    // Calls fn for every element in [lo, hi) in ascending order. Elements
+    // are read straight from the leaf list, without iterators.
+    // Time: O(log(n) + k), k is the number of elements in range.
+    template<class F>
+    void for_each_range(const T& lo, const T& hi, F&& fn) const;
+
+    // Copies elements in [lo, hi) to out in ascending order and returns the
+    // iterator past the last written element. Time: O(log(n) + k).
+    template<class OutputIterator>
+    OutputIterator copy_range(const T& lo, const T& hi,
+                              OutputIterator out) const;
+
+    // Calls fn for every element from up to threads threads, 0 means
+    // std::thread::hardware_concurrency(). Every thread visits runs of the
+    // leaf list in ascending order, but runs are visited in no particular
+    // order, so fn must be safe to call concurrently. The first exception
+    // thrown by fn is rethrown once all threads stop.
+    // Time: O(n / threads + threads).
+    template<class F>
+    void parallel_for_each(F&& fn, size_t threads = 0) const;
+
+    // Writes find(key) to out for every key in [first, last) and returns the
+    // iterator past the last written element. Keys are descended in groups,
+    // level by level, with the next level prefetched, so cache misses of
+    // different keys overlap. Sorted groups also share the common part of
+    // their paths. Time: O(k * log(n)), k is the number of keys.
+    template<class ForwardIterator, class OutputIterator>
+    OutputIterator find_batch(ForwardIterator first, ForwardIterator last,
+                              OutputIterator out) const;
+
+    // Writes contains(key) to out for every key in [first, last), like
+    // find_batch. Time: O(k * log(n)).
+    template<class ForwardIterator, class OutputIterator>
+    OutputIterator contains_batch(ForwardIterator first, ForwardIterator last,
+                                  OutputIterator out) const;
+
   private:
-    // Make node's data valid. Time: O(1).
-    void update_(Node* node);
+    using Counters = CounterHolder<true>;
+
+    // Allocates internal node without sons. Time: O(1).
+    Inner* new_inner_();
+
+    // Allocates leaf holding key constructed from args. Time: O(1).
+    template<class... Args>
+    Leaf* new_leaf_(Args&&... args);
+
+    // Frees leaf with its key. Time: O(1).
+    void delete_leaf_(Leaf* node);
+
+    // Frees internal node with its keys, but not its sons. Time: O(1).
+    void delete_inner_(Inner* node);
+
+    // Adds n to counter c. Does nothing without counters. Time: O(1).
+    template<class Counter>
+    inline void count_(Counter c, uint64_t n = 1) const {
+        if constexpr (Policy::counters) {
+            this->counts[c].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns key of val if it's an element, or anything else the
+    // comparator doesn't take, otherwise val, which is a key.
+    template<class A>
+    static inline const auto& key_of_(const A& val) {
+        if constexpr (std::is_same_v<A, T> ||
+                      !std::is_invocable_v<const Compare&, const Key&,
+                                           const A&>) {
+            return Policy::key_of::key(val);
+        } else {
+            return val;
+        }
+    }
+
+    // Compares keys, or keys of elements, with the set's comparator.
+    template<class A, class B>
+    inline bool less_(const A& a, const B& b) const {
+        count_(Counters::COMPARISONS);
+        return this->comp()(key_of_(a), key_of_(b));
+    }
+
+    // Returns max key of node's subtree. Time: O(1).
+    static const Key& max_key_(const Node* node);
+
+    // Returns index of the first son of node with max key not less than the
+    // given key, or sons_size if there is no such son. Time: O(MAX_SONS).
+    template<class K>
+    size_t lower_son_(const Inner* node, const K& key) const;
+
+    // Inserts leaf into leaf list before next. Time: O(1).
+    static void link_before_(Link* next, Link* leaf);
+
+    // Removes leaf from leaf list. Time: O(1).
+    static void unlink_(Link* leaf);
+
+    // Moves leaf list from one end node to another. Time: O(1).
+    static void move_list_(Link& from, Link& to);
+
+    // Inserts son into node at position pos. Time: O(1).
+    void insert_son_(Inner* node, size_t pos, Node* son);
 
-    // Processes the case if node has 4 sons. Time: O(log(n)).
-    void fix4sons_(Node* node);
+    // Removes son at position pos from node without freeing it. Time: O(1).
+    void erase_son_(Inner* node, size_t pos);
 
-    // Processes the case if node has 1 son. Time: O(log(n)).
-    void fix1sons_(Node* node);
+    // Copies node's max key to its parent, and further up while node is the
+    // last son. Time: O(log(n)).
+    void update_max_(Node* node);
 
-    // Fix sons order in node. Time: O(1).
-    void sort_sons(Node* node);
+    // Returns number of leaves in node's subtree. Needs order statistics.
+    // Time: O(MAX_SONS).
+    static size_t subtree_size_(const Node* node);
+
+    // Stores size of node's subtree in its parent. Does nothing without order
+    // statistics. Time: O(MAX_SONS).
+    static void update_size_(Node* node);
+
+    // Adds delta to sizes of subtrees containing node, except node's own.
+    // Does nothing without order statistics. Time: O(log(n)).
+    static void add_size_(Node* node, ptrdiff_t delta);
+
+    // Moves count sons of from starting at first, with their keys and sizes,
+    // to position pos of to. Time: O(MAX_SONS).
+    void move_sons_(Inner* from, size_t first, size_t count, Inner* to,
+                    size_t pos);
+
+    // Splits node and its ancestors while they have too many sons.
+    // Time: O(log(n)).
+    void fix_overflow_(Inner* node);
+
+    // Splits node with too many sons into two halves, adding a root if
+    // needed. Time: O(MAX_SONS).
+    void split_node_(Inner* node);
+
+    // Rebalances node and its ancestors while they have too few sons, and
+    // removes the root with a single son. Time: O(log(n)).
+    void fix_underflow_(Inner* node);
+
+    // Evens out sons of node, which has too few of them, and its brother,
+    // or merges them if they fit in one node. Returns the parent if it lost
+    // a son, otherwise nullptr. Time: O(MAX_SONS).
+    Inner* rebalance_(Inner* node);
 
     // Returns pointer to the first node with element not less than the given key
     // Time: O(log(n)).
-    Node* lower_bound_(const T& elem);
+    template<class K>
+    Leaf* lower_bound_(const K& key);
+
+    // Returns the first leaf of node's subtree not less than the given key,
+    // or its last leaf if there is no such leaf. Time: O(log(n)).
+    template<class K>
+    Leaf* descend_(Node* node, const K& key);
+
+    // Same as lower_bound_, but climbs from finger, a leaf not greater than
+    // the key, only as far as needed. Time: O(log(d)) amortized, d is the
+    // distance between finger and the result.
+    template<class K>
+    Leaf* lower_bound_from_(Leaf* finger, const K& key);
+
+    // Inserts elem unless the set contains it. Time: O(log(n)).
+    template<class V>
+    std::pair<Iterator, bool> insert_(V&& elem);
+
+    // Inserts elem next to pos, the result of lower_bound_(elem), unless pos
+    // is equal to it. Returns the leaf with elem and whether insertion took
+    // place. Time: O(log(n)).
+    template<class V>
+    std::pair<Leaf*, bool> insert_at_(Leaf* pos, V&& elem);
+
+    // Puts new leaf next to pos, the result of lower_bound_(node->val), or
+    // nullptr if the set is empty. Returns node. Time: O(log(n)) worst
+    // case, O(1) amortized.
+    Leaf* link_leaf_(Leaf* pos, Leaf* node);
+
+    // Inserts constructed leaf unless the set contains its key, then the
+    // leaf is freed. Returns the leaf with the key and whether insertion
+    // took place. Time: O(log(n)).
+    std::pair<Leaf*, bool> insert_leaf_(Leaf* node);
+
+    // Removes leaf from the tree and frees it. Time: O(log(n)).
+    void erase_leaf_(Leaf* node);
+
+    // Same as split, but left_size, the number of elements less than key, is
+    // given. Time: O(log(n)).
+    std::pair<Set<T, Compare, Allocator, Policy>,
+              Set<T, Compare, Allocator, Policy>>
+    split_(const T& key, size_t left_size);
+
+    // Removes leaf from the tree and the leaf list, keeping it allocated.
+    // Time: O(log(n)).
+    void unlink_leaf_(Leaf* node);
+
+    // Inserts sorted range of count elements by rebuilding the tree.
+    // Time: O(n + count).
+    template<class ForwardIterator>
+    void merge_sorted_(ForwardIterator first, ForwardIterator last,
+                       size_t count);
+
+    // Removes sorted range of count elements by rebuilding the tree.
+    // Time: O(n + count).
+    template<class ForwardIterator>
+    void subtract_sorted_(ForwardIterator first, ForwardIterator last,
+                          size_t count);
+
+    // Returns height of tree, leaves have height 0. Time: O(log(n)).
+    static size_t height_(const Node* root);
+
+    // Returns number of leaves before the given one, or size() for
+    // END_NODE_. Time: O(log(n)) with order statistics, otherwise
+    // O(min(k, n - k)).
+    size_t count_before_(const Link* leaf) const;
+
+    // Joins tree of tree_height to the right border of this tree of height,
+    // or to the left one if right is false. Keys of both trees must not
+    // overlap. Returns new height of this tree. Time: O(log(n)).
+    size_t attach_(size_t height, Node* tree, size_t tree_height, bool right);
+
+    // Walks a and b in ascending order and passes to push elements only in
+    // a, only in b, or in both, as chosen by the flags. Runs that are not
+    // passed are skipped by finger searches. Time: O(n + m) when all kinds
+    // are passed, O(m * log(n / m + 1)) when only common ones are.
+    template<class F>
+    static void merge_(const Set& a, const Set& b, bool only_a, bool only_b,
+                       bool both, F&& push);
+
+    // Deletes trees of the given roots, skipping repeated roots and roots
+    // that are parts of other trees. Used to clean up after a failed split
+    // or join. Time: O(n).
+    void destruct_roots_(Node** first, Node** last);
+
+    // Returns the first leaf not less than the given key, or END_NODE_.
+    // Time: O(log(n)).
+    template<class K>
+    const Link* lower_link_(const K& key) const;
+
+    // Returns the first leaf of node's subtree not less than the given key,
+    // or END_NODE_. Time: O(log(n)).
+    template<class K>
+    const Link* lower_link_below_(const Node* node, const K& key) const;
+
+    // Same as lower_link_, but climbs from finger, a leaf not greater than
+    // the key, only as far as needed. Time: O(log(d)) amortized, d is the
+    // distance between finger and the result.
+    template<class K>
+    const Link* lower_link_from_(const Link* finger, const K& key) const;
+
+    // Returns the leaf equal to the given key, or END_NODE_. Time: O(log(n)).
+    template<class K>
+    const Link* find_(const K& key) const;
+
+    // Removes element equal to the given key. Time: O(log(n)).
+    template<class K>
+    void erase_(const K& key);
+
+    // Hints the cache to load node. Does not fault on any address.
+    static void prefetch_(const Node* node);
+
+    // Calls emit with find_(key) for every key in [first, last), in order.
+    // Time: O(k * log(n)).
+    template<class ForwardIterator, class F>
+    void find_batch_(ForwardIterator first, ForwardIterator last,
+                     F&& emit) const;
+
+    // Fills empty set with elements from sorted range. Time: O(n).
+    template<typename InputIterator>
+    void build_sorted_(InputIterator first, InputIterator last);
+
+    // Fills empty set with elements that fill passes in ascending order to
+    // the callback it is given. Leaves are collected in level, which may
+    // have reserved space. Time: O(n).
+    template<class F>
+    void build_from_(std::vector<Node*>& level, F&& fill);
+
+    // Builds tree over nodes of one height, sorted by their keys. Nodes are
+    // grouped level by level, so level is overwritten. Time: O(n).
+    void build_(std::vector<Node*>& level);
+
+    // Fills empty set with n elements of sorted range, leaves are made by
+    // tasks tasks on ALLOC_THREADS threads. Time: O(n / tasks + n / MAX_SONS).
+    template<class RandomIt>
+    void parallel_build_(RandomIt first, size_t n, size_t tasks);
+
+    // Copy tree, appending its leaves to list. Nodes are allocated in
+    // pre-order, without recursion, so with PoolAllocator the leaves of the
+    // copy lie in key order. Time: O(n).
+    Node* copy_(const Node* root, Link& list);
+
+    // Copies tree of size elements, appending its leaves to END_NODE_.
+    // Subtrees are copied by ALLOC_THREADS threads. Time: O(n / threads).
+    Node* parallel_copy_(const Node* root, size_t size);
+
+    // Copies upper depth levels of tree, and puts pieces[used...] in place
+    // of the nodes below. Time: O(number of copied nodes).
+    Node* copy_top_(const Node* root, size_t depth, Node* const* pieces,
+                    size_t& used);
+
+    // Deletes all nodes of tree in post-order, without recursion.
+    // Time: O(n).
+    void destruct_(Node* root);
+
+    // Checks whether all nodes can be dropped with the arena, which is true
+    // only if this set owns the arena exclusively and no node needs a
+    // destructor call. Time: O(1).
+    bool drops_with_arena_() const;
+
+    // Deletes tree of size elements, subtrees are deleted by
+    // ALLOC_THREADS threads. Time: O(n / threads).
+    void parallel_destruct_(Node* root, size_t size);
+
+    // Deletes internal nodes of upper depth levels of tree. Time: O(number
+    // of deleted nodes).
+    void destruct_top_(Node* root, size_t depth);
+
+    // Returns number of threads given by threads, where 0 means all hardware
+    // threads. Time: O(1).
+    static size_t threads_(size_t threads);
+
+    // Returns how many tasks to split work on n elements into for threads
+    // threads. Time: O(1).
+    static size_t parallel_tasks_(size_t n, size_t threads);
+
+    // Calls fn(i) for every i in [0, tasks) on up to threads threads, the
+    // calling one included. Rethrows the first exception thrown by fn once
+    // all threads stop. Time: O(tasks / threads) calls of fn.
+    template<class F>
+    static void parallel_run_(size_t tasks, size_t threads, F&& fn);
+
+    // Returns nodes of the first depth of tree with at least count nodes, or
+    // the leaves, in key order. Sets depth to their depth. Time: O(count).
+    static std::vector<Node*> frontier_(Node* root, size_t count,
+                                        size_t& depth);
+
+    // Moves all leaves of list before next. Time: O(1).
+    static void splice_before_(Link* next, Link& list);
+
+    // Deletes internal nodes of tree, keeping its leaves. Time: O(n).
+    void destruct_inners_(Node* root);
+
+  private:
+    // Number of allocator members below, which share one arena with
+    // PoolAllocator. Keep it in sync with them.
+    static constexpr long ALLOCATORS = 3;
+
+    Allocator alloc_;
+    LeafAllocator leaf_alloc_{alloc_};
+    InnerAllocator inner_alloc_{alloc_};
+    Node* root_ = nullptr;
+    size_t size_ = 0;
+    uint64_t version_ = 0;
+    Link END_NODE_;
+};
+
+// Set built on B-tree with MinSons to MaxSons sons per internal node.
+template<class T, size_t MinSons, size_t MaxSons,
+         class Compare = std::less<T>, class Allocator = std::allocator<T>>
+using BasicSet = Set<T, Compare, Allocator, FanoutPolicy<MinSons, MaxSons>>;
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>::Set(const Compare& comp,
+                                        const Allocator& alloc)
+    : CompareHolder<Compare>(comp),
+      alloc_(alloc),
+      leaf_alloc_(alloc),
+      inner_alloc_(alloc) {}
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>::Set(const Allocator& alloc)
+    : Set(Compare(), alloc) {}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class InputIterator>
+Set<T, Compare, Allocator, Policy>::Set(InputIterator first,
+                                        InputIterator last,
+                                        const Compare& comp,
+                                        const Allocator& alloc)
+    : Set(comp, alloc) {
+    using Category =
+        typename std::iterator_traits<InputIterator>::iterator_category;
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag, Category>) {
+        auto less = [this](const T& a, const T& b) { return less_(a, b); };
+        if (std::is_sorted(first, last, less)) {
+            build_sorted_(first, last);
+            return;
+        }
+    }
+    for (InputIterator i = first; i != last; ++i) {
+        insert(*i);
+    }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class InputIterator>
+Set<T, Compare, Allocator, Policy>::Set(InputIterator first,
+                                        InputIterator last,
+                                        const Allocator& alloc)
+    : Set(first, last, Compare(), alloc) {}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class InputIterator>
+Set<T, Compare, Allocator, Policy>::Set(assume_sorted_t, InputIterator first,
+                                        InputIterator last,
+                                        const Compare& comp,
+                                        const Allocator& alloc)
+    : Set(comp, alloc) {
+    build_sorted_(first, last);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>::Set(std::initializer_list<T> elems,
+                                        const Compare& comp,
+                                        const Allocator& alloc)
+    : Set(elems.begin(), elems.end(), comp, alloc) {}
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>::Set(std::initializer_list<T> elems,
+                                        const Allocator& alloc)
+    : Set(elems.begin(), elems.end(), Compare(), alloc) {}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class InputIterator>
+Set<T, Compare, Allocator, Policy>
+Set<T, Compare, Allocator, Policy>::from_sorted(InputIterator first,
+                                                InputIterator last,
+                                                const Compare& comp,
+                                                const Allocator& alloc) {
+    return Set<T, Compare, Allocator, Policy>(assume_sorted, first, last,
+                                              comp, alloc);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class InputIterator>
+void Set<T, Compare, Allocator, Policy>::build_sorted_(InputIterator first,
+                                      InputIterator last) {
+    std::vector<Node*> level;
+    using Category =
+        typename std::iterator_traits<InputIterator>::iterator_category;
+    if constexpr (std::is_base_of_v<std::random_access_iterator_tag,
+                                    Category>) {
+        size_t n = last - first;
+        size_t tasks = parallel_tasks_(n, ALLOC_THREADS);
+        if (tasks > 1) {
+            parallel_build_(first, n, tasks);
+            return;
+        }
+    }
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag, Category>) {
+        level.reserve(std::distance(first, last));
+    }
+    build_from_(level, [&first, &last](auto& push) {
+        for (; first != last; ++first) {
+            push(*first);
+        }
+    });
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class F>
+void Set<T, Compare, Allocator, Policy>::build_from_(std::vector<Node*>& level,
+                                                     F&& fill) {
+    auto push = [this, &level](const T& val) {
+        if (!level.empty() && !less_(max_key_(level.back()), val)) {
+            return;
+        }
+        level.push_back(nullptr);
+        Leaf* leaf = new_leaf_(val);
+        link_before_(&END_NODE_, leaf);
+        level.back() = leaf;
+    };
+    try {
+        fill(push);
+    } catch (...) {
+        if (!level.empty() && level.back() == nullptr) {
+            level.pop_back();
+        }
+        for (Node* node : level) {
+            delete_leaf_(static_cast<Leaf*>(node));
+        }
+        END_NODE_.prev = END_NODE_.next = &END_NODE_;
+        throw;
+    }
+    size_ = level.size();
+    build_(level);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class RandomIt>
+void Set<T, Compare, Allocator, Policy>::parallel_build_(RandomIt first,
+                                                         size_t n,
+                                                         size_t tasks) {
+    // Every task makes leaves of its part of the range, skipping keys equal
+    // to the previous ones, into its own list.
+    std::vector<std::vector<Node*>> parts(tasks);
+    std::unique_ptr<Link[]> lists(new Link[tasks]);
+    std::vector<Node*> level;
+    try {
+        parallel_run_(tasks, ALLOC_THREADS, [&](size_t t) {
+            size_t lo = n * t / tasks;
+            size_t hi = n * (t + 1) / tasks;
+            parts[t].reserve(hi - lo);
+            for (size_t i = lo; i < hi; ++i) {
+                if (i > 0 && !less_(first[i - 1], first[i])) {
+                    continue;
+                }
+                Leaf* leaf = new_leaf_(first[i]);
+                link_before_(&lists[t], leaf);
+                parts[t].push_back(leaf);
+            }
+        });
+        level.reserve(n);
+    } catch (...) {
+        for (const auto& part : parts) {
+            for (Node* node : part) {
+                delete_leaf_(static_cast<Leaf*>(node));
+            }
+        }
+        throw;
+    }
+    for (size_t t = 0; t < tasks; ++t) {
+        level.insert(level.end(), parts[t].begin(), parts[t].end());
+        splice_before_(&END_NODE_, lists[t]);
+    }
+    size_ = level.size();
+    build_(level);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::build_(std::vector<Node*>& level) {
+    size_t count = level.size();
+    while (count > 1) {
+        // Sons are spread evenly, so every parent gets at least MIN_SONS
+        // of them, first (count % parents) get one more.
+        size_t parents = (count + MAX_SONS - 2) / (MAX_SONS - 1);
+        size_t base = count / parents;
+        size_t extra = count % parents;
+        size_t read = 0;
+        size_t write = 0;
+        Inner* parent = nullptr;
+        try {
+            for (; write < parents; ++write) {
+                parent = new_inner_();
+                size_t sons = base + (write < extra ? 1 : 0);
+                for (size_t i = 0; i < sons; ++i, ++read) {
+                    insert_son_(parent, i, level[read]);
+                }
+                level[write] = parent;
+                parent = nullptr;
+            }
+        } catch (...) {
+            if (parent != nullptr) {
+                for (size_t i = 0; i < parent->sons_size; ++i) {
+                    destruct_(parent->sons[i]);
+                }
+                delete_inner_(parent);
+            }
+            for (size_t i = 0; i < write; ++i) {
+                destruct_(level[i]);
+            }
+            for (size_t i = read; i < count; ++i) {
+                destruct_(level[i]);
+            }
+            size_ = 0;
+            END_NODE_.prev = END_NODE_.next = &END_NODE_;
+            throw;
+        }
+        count = parents;
+    }
+    root_ = (count == 0 ? nullptr : level[0]);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Inner*
+Set<T, Compare, Allocator, Policy>::new_inner_() {
+    Inner* node = InnerTraits::allocate(inner_alloc_, 1);
+    InnerTraits::construct(inner_alloc_, node);
+    count_(Counters::ALLOCATIONS);
+    return node;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class... Args>
+typename Set<T, Compare, Allocator, Policy>::Leaf*
+Set<T, Compare, Allocator, Policy>::new_leaf_(Args&&... args) {
+    Leaf* node = LeafTraits::allocate(leaf_alloc_, 1);
+    try {
+        LeafTraits::construct(leaf_alloc_, node, std::forward<Args>(args)...);
+    } catch (...) {
+        LeafTraits::deallocate(leaf_alloc_, node, 1);
+        throw;
+    }
+    count_(Counters::ALLOCATIONS);
+    return node;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::delete_leaf_(Leaf* node) {
+    LeafTraits::destroy(leaf_alloc_, node);
+    LeafTraits::deallocate(leaf_alloc_, node, 1);
+    count_(Counters::DEALLOCATIONS);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::delete_inner_(Inner* node) {
+    for (size_t i = 0; i < node->sons_size; ++i) {
+        KeyTraits::destroy(alloc_, &node->key(i));
+    }
+    InnerTraits::destroy(inner_alloc_, node);
+    InnerTraits::deallocate(inner_alloc_, node, 1);
+    count_(Counters::DEALLOCATIONS);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+const typename Set<T, Compare, Allocator, Policy>::Key&
+Set<T, Compare, Allocator, Policy>::max_key_(const Node* node) {
+    if (node->sons_size == 0) {
+        return key_of_(static_cast<const Leaf*>(node)->val);
+    }
+    const Inner* inner = static_cast<const Inner*>(node);
+    return inner->key(inner->sons_size - 1);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+size_t Set<T, Compare, Allocator, Policy>::lower_son_(const Inner* node,
+                                                      const K& key) const {
+    count_(Counters::NODE_VISITS);
+    if constexpr (std::is_arithmetic_v<Key> && std::is_arithmetic_v<K> &&
+                  (std::is_same_v<Compare, std::less<Key>> ||
+                   std::is_same_v<Compare, std::less<>>)) {
+        // Keys are sorted, so the index is the number of keys less than
+        // key. Counting them doesn't branch on key values.
+        size_t count = 0;
+        for (size_t i = 0; i < node->sons_size; ++i) {
+            count += (node->key(i) < key ? 1 : 0);
+        }
+        count_(Counters::COMPARISONS, node->sons_size);
+        return count;
+    }
+    size_t i = 0;
+    while (i < node->sons_size && less_(node->key(i), key)) {
+        ++i;
+    }
+    return i;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+typename Set<T, Compare, Allocator, Policy>::Leaf*
+Set<T, Compare, Allocator, Policy>::lower_bound_(const K& key) {
+    return descend_(root_, key);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+typename Set<T, Compare, Allocator, Policy>::Leaf*
+Set<T, Compare, Allocator, Policy>::descend_(Node* node, const K& key) {
+    while (node->sons_size) {
+        Inner* inner = static_cast<Inner*>(node);
+        node = inner->sons[std::min(lower_son_(inner, key),
+                                    inner->sons_size - 1)];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+typename Set<T, Compare, Allocator, Policy>::Leaf*
+Set<T, Compare, Allocator, Policy>::lower_bound_from_(Leaf* finger,
+                                                      const K& key) {
+    // Leaves before finger's ancestors are less than finger, so the first
+    // ancestor with max key not less than the given one holds the answer.
+    Node* node = finger;
+    while (node->parent != nullptr && less_(max_key_(node), key)) {
+        node = node->parent;
+    }
+    return descend_(node, key);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+const typename Set<T, Compare, Allocator, Policy>::Link*
+Set<T, Compare, Allocator, Policy>::lower_link_(const K& key) const {
+    if (size_ == 0) {
+        return &END_NODE_;
+    }
+    return lower_link_below_(root_, key);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+const typename Set<T, Compare, Allocator, Policy>::Link*
+Set<T, Compare, Allocator, Policy>::lower_link_from_(const Link* finger,
+                                                     const K& key) const {
+    const Node* node = static_cast<const Leaf*>(finger);
+    while (node->parent != nullptr && less_(max_key_(node), key)) {
+        node = node->parent;
+    }
+    return lower_link_below_(node, key);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+const typename Set<T, Compare, Allocator, Policy>::Link*
+Set<T, Compare, Allocator, Policy>::lower_link_below_(const Node* node,
+                                                      const K& key) const {
+    while (node->sons_size) {
+        const Inner* inner = static_cast<const Inner*>(node);
+        size_t i = lower_son_(inner, key);
+        if (i == inner->sons_size) {
+            return &END_NODE_;
+        }
+        node = inner->sons[i];
+    }
+    const Leaf* leaf = static_cast<const Leaf*>(node);
+    if (less_(leaf->val, key)) {
+        return &END_NODE_;
+    }
+    return leaf;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+const typename Set<T, Compare, Allocator, Policy>::Link*
+Set<T, Compare, Allocator, Policy>::find_(const K& key) const {
+    const Link* link = lower_link_(key);
+    if (link == &END_NODE_ ||
+        less_(key, static_cast<const Leaf*>(link)->val)) {
+        return &END_NODE_;
+    }
+    return link;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Iterator
+Set<T, Compare, Allocator, Policy>::lower_bound(const T& elem) const {
+    return Iterator(lower_link_(elem), this);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K, class C, class>
+typename Set<T, Compare, Allocator, Policy>::Iterator
+Set<T, Compare, Allocator, Policy>::lower_bound(const K& key) const {
+    return Iterator(lower_link_(key), this);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Iterator
+Set<T, Compare, Allocator, Policy>::find(const T& elem) const {
+    return Iterator(find_(elem), this);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K, class C, class>
+typename Set<T, Compare, Allocator, Policy>::Iterator
+Set<T, Compare, Allocator, Policy>::find(const K& key) const {
+    return Iterator(find_(key), this);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+bool Set<T, Compare, Allocator, Policy>::contains(const T& elem) const {
+    return find_(elem) != &END_NODE_;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K, class C, class>
+bool Set<T, Compare, Allocator, Policy>::contains(const K& key) const {
+    return find_(key) != &END_NODE_;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Iterator
+Set<T, Compare, Allocator, Policy>::nth(size_t k) const {
+    static_assert(Policy::order_statistics, "order statistics are disabled");
+    if (k >= size_) {
+        return end();
+    }
+    const Node* node = root_;
+    while (node->sons_size) {
+        const Inner* inner = static_cast<const Inner*>(node);
+        size_t i = 0;
+        while (k >= inner->sizes[i]) {
+            k -= inner->sizes[i++];
+        }
+        node = inner->sons[i];
+    }
+    return Iterator(static_cast<const Leaf*>(node), this);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+size_t Set<T, Compare, Allocator, Policy>::rank(const T& elem) const {
+    static_assert(Policy::order_statistics, "order statistics are disabled");
+    if (size_ == 0) {
+        return 0;
+    }
+    size_t rank = 0;
+    const Node* node = root_;
+    while (node->sons_size) {
+        const Inner* inner = static_cast<const Inner*>(node);
+        size_t i = lower_son_(inner, elem);
+        for (size_t j = 0; j < i; ++j) {
+            rank += inner->sizes[j];
+        }
+        if (i == inner->sons_size) {
+            return rank;
+        }
+        node = inner->sons[i];
+    }
+    return rank + (less_(static_cast<const Leaf*>(node)->val, elem) ? 1 : 0);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+size_t Set<T, Compare, Allocator, Policy>::count_range(const T& lo,
+                                                       const T& hi) const {
+    if (!less_(lo, hi)) {
+        return 0;
+    }
+    return rank(hi) - rank(lo);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class F>
+void Set<T, Compare, Allocator, Policy>::for_each_range(const T& lo,
+                                                        const T& hi,
+                                                        F&& fn) const {
+    for (const Link* cur = lower_link_(lo); cur != &END_NODE_;
+         cur = cur->next) {
+        const T& val = static_cast<const Leaf*>(cur)->val;
+        if (!less_(val, hi)) {
+            return;
+        }
+        fn(val);
+    }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class F>
+void Set<T, Compare, Allocator, Policy>::parallel_for_each(
+    F&& fn, size_t threads) const {
+    size_t tasks = parallel_tasks_(size_, threads);
+    if (tasks <= 1) {
+        for (const Link* leaf = END_NODE_.next; leaf != &END_NODE_;
+             leaf = leaf->next) {
+            fn(static_cast<const Leaf*>(leaf)->val);
+        }
+        return;
+    }
+    size_t depth = 0;
+    std::vector<Node*> tops = frontier_(root_, tasks, depth);
+    parallel_run_(tops.size(), threads, [&fn, &tops](size_t i) {
+        const Node* first = tops[i];
+        const Node* last = tops[i];
+        while (first->sons_size != 0) {
+            first = static_cast<const Inner*>(first)->sons[0];
+            last = static_cast<const Inner*>(last)
+                       ->sons[last->sons_size - 1];
+        }
+        const Link* end = static_cast<const Link*>(last)->next;
+        for (const Link* leaf = static_cast<const Link*>(first); leaf != end;
+             leaf = leaf->next) {
+            fn(static_cast<const Leaf*>(leaf)->val);
+        }
+    });
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class OutputIterator>
+OutputIterator Set<T, Compare, Allocator, Policy>::copy_range(
+    const T& lo, const T& hi, OutputIterator out) const {
+    for_each_range(lo, hi, [&out](const T& val) { *out++ = val; });
+    return out;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class ForwardIterator, class OutputIterator>
+OutputIterator Set<T, Compare, Allocator, Policy>::find_batch(
+    ForwardIterator first, ForwardIterator last, OutputIterator out) const {
+    find_batch_(first, last, [this, &out](const Link* link) {
+        *out++ = Iterator(link, this);
+    });
+    return out;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class ForwardIterator, class OutputIterator>
+OutputIterator Set<T, Compare, Allocator, Policy>::contains_batch(
+    ForwardIterator first, ForwardIterator last, OutputIterator out) const {
+    find_batch_(first, last, [this, &out](const Link* link) {
+        *out++ = (link != &END_NODE_);
+    });
+    return out;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+SetCounters Set<T, Compare, Allocator, Policy>::counters() const {
+    static_assert(Policy::counters, "counters are disabled");
+    auto get = [this](Counters::Counter c) {
+        return this->counts[c].load(std::memory_order_relaxed);
+    };
+    SetCounters res;
+    res.comparisons = get(Counters::COMPARISONS);
+    res.node_visits = get(Counters::NODE_VISITS);
+    res.splits = get(Counters::SPLITS);
+    res.merges = get(Counters::MERGES);
+    res.borrows = get(Counters::BORROWS);
+    res.allocations = get(Counters::ALLOCATIONS);
+    res.deallocations = get(Counters::DEALLOCATIONS);
+    return res;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::reset_counters() {
+    static_assert(Policy::counters, "counters are disabled");
+    for (auto& count : this->counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+SetStats Set<T, Compare, Allocator, Policy>::stats() const {
+    SetStats res;
+    res.sons_counts.assign(MAX_SONS, 0);
+    res.height = height_(root_);
+    res.leaves = size_;
+    size_t sons = 0;
+    std::vector<const Node*> stack;
+    if (root_ != nullptr && root_->sons_size != 0) {
+        stack.push_back(root_);
+    }
+    while (!stack.empty()) {
+        const Inner* node = static_cast<const Inner*>(stack.back());
+        stack.pop_back();
+        ++res.inner_nodes;
+        ++res.sons_counts[node->sons_size];
+        sons += node->sons_size;
+        for (size_t i = 0; i < node->sons_size; ++i) {
+            if (node->sons[i]->sons_size != 0) {
+                stack.push_back(node->sons[i]);
+            }
+        }
+    }
+    res.bytes = sizeof(*this) + res.leaves * sizeof(Leaf) +
+                res.inner_nodes * sizeof(Inner);
+    if (res.inner_nodes != 0) {
+        res.fill = static_cast<double>(sons) /
+                   static_cast<double>(res.inner_nodes * Policy::max_sons);
+    }
+    return res;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::prefetch_(const Node* node) {
+#if defined(__GNUC__) || defined(__clang__)
+    // Inner nodes span more than one cache line, leaves are smaller, but
+    // prefetching past an object is harmless.
+    const char* ptr = reinterpret_cast<const char*>(node);
+    for (size_t offset = 0; offset < sizeof(Inner); offset += 64) {
+        __builtin_prefetch(ptr + offset);
+    }
+#else
+    (void)node;
+#endif
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class ForwardIterator, class F>
+void Set<T, Compare, Allocator, Policy>::find_batch_(ForwardIterator first,
+                                                     ForwardIterator last,
+                                                     F&& emit) const {
+    using Probe = typename std::iterator_traits<ForwardIterator>::value_type;
+    std::array<ForwardIterator, BATCH_SIZE> keys;
+    std::array<const Node*, BATCH_SIZE> nodes;
+    while (first != last) {
+        size_t count = 0;
+        for (; first != last && count < BATCH_SIZE; ++first) {
+            keys[count++] = first;
+        }
+        if (size_ == 0) {
+            for (size_t j = 0; j < count; ++j) {
+                emit(&END_NODE_);
+            }
+            continue;
+        }
+
+        // Keys of a sorted group lie between the first and the last one, so
+        // while those two go to the same son, all keys do.
+        const Node* start = root_;
+        if constexpr (std::is_same_v<Probe, T>) {
+            const T& lo = *keys[0];
+            const T& hi = *keys[count - 1];
+            bool sorted = true;
+            for (size_t j = 1; j < count && sorted; ++j) {
+                sorted = !less_(*keys[j], *keys[j - 1]);
+            }
+            while (sorted && start->sons_size) {
+                const Inner* inner = static_cast<const Inner*>(start);
+                size_t i = lower_son_(inner, lo);
+                if (i == inner->sons_size || i != lower_son_(inner, hi)) {
+                    break;
+                }
+                start = inner->sons[i];
+            }
+        }
+        nodes.fill(start);
+
+        // All leaves have the same depth, so the keys move down in lockstep.
+        // A key leaves the race with nullptr once it exceeds every key of
+        // its subtree.
+        bool descended = true;
+        while (descended) {
+            descended = false;
+            for (size_t j = 0; j < count; ++j) {
+                const Node* node = nodes[j];
+                if (node == nullptr || node->sons_size == 0) {
+                    continue;
+                }
+                const Inner* inner = static_cast<const Inner*>(node);
+                size_t i = lower_son_(inner, *keys[j]);
+                if (i == inner->sons_size) {
+                    nodes[j] = nullptr;
+                    continue;
+                }
+                nodes[j] = inner->sons[i];
+                if (j == 0 || nodes[j] != nodes[j - 1]) {
+                    prefetch_(nodes[j]);
+                }
+                descended = true;
+            }
+        }
+
+        for (size_t j = 0; j < count; ++j) {
+            const Leaf* leaf = static_cast<const Leaf*>(nodes[j]);
+            if (leaf == nullptr || less_(leaf->val, *keys[j]) ||
+                less_(*keys[j], leaf->val)) {
+                emit(&END_NODE_);
+            } else {
+                emit(leaf);
+            }
+        }
+    }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::link_before_(Link* next, Link* leaf) {
+    leaf->prev = next->prev;
+    leaf->next = next;
+    next->prev->next = leaf;
+    next->prev = leaf;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::unlink_(Link* leaf) {
+    leaf->prev->next = leaf->next;
+    leaf->next->prev = leaf->prev;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::move_list_(Link& from, Link& to) {
+    if (from.next == &from) {
+        to.prev = to.next = &to;
+        return;
+    }
+    to.prev = from.prev;
+    to.next = from.next;
+    to.prev->next = to.next->prev = &to;
+    from.prev = from.next = &from;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::insert_son_(Inner* node, size_t pos,
+                                                     Node* son) {
+    size_t last = node->sons_size;
+    if (pos == last) {
+        KeyTraits::construct(alloc_, &node->key(pos), max_key_(son));
+    } else {
+        KeyTraits::construct(alloc_, &node->key(last),
+                             std::move(node->key(last - 1)));
+        for (size_t i = last - 1; i > pos; --i) {
+            node->key(i) = std::move(node->key(i - 1));
+        }
+        node->key(pos) = max_key_(son);
+        for (size_t i = last; i > pos; --i) {
+            node->sons[i] = node->sons[i - 1];
+            node->sons[i]->index = i;
+            if constexpr (Policy::order_statistics) {
+                node->sizes[i] = node->sizes[i - 1];
+            }
+        }
+    }
+    node->sons[pos] = son;
+    son->parent = node;
+    son->index = pos;
+    ++node->sons_size;
+    update_size_(son);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::erase_son_(Inner* node, size_t pos) {
+    for (size_t i = pos + 1; i < node->sons_size; ++i) {
+        node->key(i - 1) = std::move(node->key(i));
+        node->sons[i - 1] = node->sons[i];
+        node->sons[i - 1]->index = i - 1;
+        if constexpr (Policy::order_statistics) {
+            node->sizes[i - 1] = node->sizes[i];
+        }
+    }
+    --node->sons_size;
+    KeyTraits::destroy(alloc_, &node->key(node->sons_size));
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::update_max_(Node* node) {
+    while (node->parent != nullptr) {
+        Inner* par = node->parent;
+        size_t pos = node->index;
+        par->key(pos) = max_key_(node);
+        if (pos + 1 != par->sons_size) {
+            return;
+        }
+        node = par;
+    }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+size_t Set<T, Compare, Allocator, Policy>::subtree_size_(const Node* node) {
+    static_assert(Policy::order_statistics, "order statistics are disabled");
+    if (node->sons_size == 0) {
+        return 1;
+    }
+    const Inner* inner = static_cast<const Inner*>(node);
+    size_t size = 0;
+    for (size_t i = 0; i < inner->sons_size; ++i) {
+        size += inner->sizes[i];
+    }
+    return size;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::update_size_(Node* node) {
+    if constexpr (Policy::order_statistics) {
+        node->parent->sizes[node->index] = subtree_size_(node);
+    }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::add_size_(Node* node,
+                                                   ptrdiff_t delta) {
+    if constexpr (Policy::order_statistics) {
+        for (; node->parent != nullptr; node = node->parent) {
+            node->parent->sizes[node->index] += delta;
+        }
+    }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::move_sons_(Inner* from, size_t first,
+                                                    size_t count, Inner* to,
+                                                    size_t pos) {
+    // Keys past the old end of to are constructed, the others assigned.
+    size_t last = to->sons_size;
+    for (size_t i = last + count; i-- > pos + count;) {
+        if (i >= last) {
+            KeyTraits::construct(alloc_, &to->key(i),
+                                 std::move(to->key(i - count)));
+        } else {
+            to->key(i) = std::move(to->key(i - count));
+        }
+        to->sons[i] = to->sons[i - count];
+        to->sons[i]->index = i;
+        if constexpr (Policy::order_statistics) {
+            to->sizes[i] = to->sizes[i - count];
+        }
+    }
+    for (size_t k = 0; k < count; ++k) {
+        size_t i = pos + k;
+        if (i >= last) {
+            KeyTraits::construct(alloc_, &to->key(i),
+                                 std::move(from->key(first + k)));
+        } else {
+            to->key(i) = std::move(from->key(first + k));
+        }
+        to->sons[i] = from->sons[first + k];
+        to->sons[i]->parent = to;
+        to->sons[i]->index = i;
+        if constexpr (Policy::order_statistics) {
+            to->sizes[i] = from->sizes[first + k];
+        }
+    }
+    to->sons_size += count;
+    for (size_t i = first + count; i < from->sons_size; ++i) {
+        from->key(i - count) = std::move(from->key(i));
+        from->sons[i - count] = from->sons[i];
+        from->sons[i - count]->index = i - count;
+        if constexpr (Policy::order_statistics) {
+            from->sizes[i - count] = from->sizes[i];
+        }
+    }
+    for (size_t i = from->sons_size - count; i < from->sons_size; ++i) {
+        KeyTraits::destroy(alloc_, &from->key(i));
+    }
+    from->sons_size -= count;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::fix_overflow_(Inner* node) {
+    for (; node->sons_size == MAX_SONS; node = node->parent) {
+        split_node_(node);
+    }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::split_node_(Inner* node) {
+    count_(Counters::SPLITS);
+    Inner* node2 = new_inner_();
+    size_t half = node->sons_size / 2;
+    move_sons_(node, node->sons_size - half, half, node2, 0);
+    if (node == root_) {
+        Inner* root = new_inner_();
+        insert_son_(root, 0, node);
+        insert_son_(root, 1, node2);
+        root_ = root;
+        return;
+    }
+    Inner* parent = node->parent;
+    size_t pos = node->index;
+    parent->key(pos) = max_key_(node);
+    update_size_(node);
+    insert_son_(parent, pos + 1, node2);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::fix_underflow_(Inner* node) {
+    while (node != nullptr) {
+        if (node == root_) {
+            if (node->sons_size == 1) {
+                root_ = node->sons[0];
+                root_->parent = nullptr;
+                delete_inner_(node);
+            }
+            return;
+        }
+        if (node->sons_size >= MIN_SONS) {
+            return;
+        }
+        node = rebalance_(node);
+    }
+}
 
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Inner*
+Set<T, Compare, Allocator, Policy>::rebalance_(Inner* node) {
+    Inner* parent = node->parent;
+    size_t pos = (node->index > 0 ? node->index - 1 : 0);
+    Inner* left = static_cast<Inner*>(parent->sons[pos]);
+    Inner* right = static_cast<Inner*>(parent->sons[pos + 1]);
+    size_t total = left->sons_size + right->sons_size;
+    if (total < 2 * MIN_SONS) {
+        count_(Counters::MERGES);
+        // Both fit in the left one then.
+        move_sons_(right, 0, right->sons_size, left, left->sons_size);
+        erase_son_(parent, pos + 1);
+        delete_inner_(right);
+        parent->key(pos) = max_key_(left);
+        update_size_(left);
+        return parent;
+    }
+    count_(Counters::BORROWS);
+    size_t half = total / 2;
+    if (left->sons_size > half) {
+        move_sons_(left, half, left->sons_size - half, right, 0);
+    } else {
+        move_sons_(right, 0, half - left->sons_size, left, left->sons_size);
+    }
+    parent->key(pos) = max_key_(left);
+    update_size_(left);
+    update_size_(right);
+    return nullptr;
+}
 
-    // Returns pointer to the next node. Time: O(log(n))
-    const Node* next_node_(const Node* cur_) const;
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Iterator
+Set<T, Compare, Allocator, Policy>::begin() const {
+    return Iterator(END_NODE_.next, this);
+}
 
-    // Returns pointer to the previous node. Time: O(log(n))
-    const Node* prev_node_(const Node* cur_) const;
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Iterator
+Set<T, Compare, Allocator, Policy>::end() const {
+    return Iterator(&END_NODE_, this);
+}
 
-    // Copy tree. Time: O(n).
-    Node* copy_(const Node* root);
+template<class T, class Compare, class Allocator, class Policy>
+std::pair<typename Set<T, Compare, Allocator, Policy>::Iterator, bool>
+Set<T, Compare, Allocator, Policy>::insert(const T& elem) {
+    return insert_(elem);
+}
 
-    // Deletes all nodes of tree. Time: O(n).
-    void destruct_(Node* root);
+template<class T, class Compare, class Allocator, class Policy>
+std::pair<typename Set<T, Compare, Allocator, Policy>::Iterator, bool>
+Set<T, Compare, Allocator, Policy>::insert(T&& elem) {
+    return insert_(std::move(elem));
+}
 
-  private:
-    Node* root_ = nullptr;
-    size_t size_ = 0;
-    uint64_t version_ = 0;
-    Node END_NODE_;
-};
+template<class T, class Compare, class Allocator, class Policy>
+template<class... Args>
+std::pair<typename Set<T, Compare, Allocator, Policy>::Iterator, bool>
+Set<T, Compare, Allocator, Policy>::emplace(Args&&... args) {
+    std::pair<Leaf*, bool> res =
+        insert_leaf_(new_leaf_(std::forward<Args>(args)...));
+    return {Iterator(res.first, this), res.second};
+}
 
-template<class T>
-template<class InputIterator>
-Set<T>::Set(InputIterator first, InputIterator last) {
-    for (InputIterator i = first; i != last; ++i) {
-        insert(*i);
+template<class T, class Compare, class Allocator, class Policy>
+template<class... Args>
+typename Set<T, Compare, Allocator, Policy>::Iterator
+Set<T, Compare, Allocator, Policy>::emplace_hint(Iterator hint,
+                                                 Args&&... args) {
+    hint.check_version_();
+    Leaf* node = new_leaf_(std::forward<Args>(args)...);
+    const Link* next = hint.cur_;
+    const Link* prev = next->prev;
+    bool fits;
+    try {
+        fits = (next == &END_NODE_ ||
+                less_(node->val, static_cast<const Leaf*>(next)->val)) &&
+               (prev == &END_NODE_ ||
+                less_(static_cast<const Leaf*>(prev)->val, node->val));
+    } catch (...) {
+        delete_leaf_(node);
+        throw;
     }
+    if (!fits) {
+        return Iterator(insert_leaf_(node).first, this);
+    }
+    // The next leaf is the lower bound, or the last one if node is the
+    // new maximum.
+    Link* pos = const_cast<Link*>(next != &END_NODE_ ? next : prev);
+    return Iterator(
+        link_leaf_(pos == &END_NODE_ ? nullptr : static_cast<Leaf*>(pos),
+                   node),
+        this);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class V>
+std::pair<typename Set<T, Compare, Allocator, Policy>::Iterator, bool>
+Set<T, Compare, Allocator, Policy>::insert_(V&& elem) {
+    std::pair<Leaf*, bool> res = insert_at_(
+        root_ == nullptr ? nullptr : lower_bound_(elem),
+        std::forward<V>(elem));
+    return {Iterator(res.first, this), res.second};
 }
 
-template<class T>
-Set<T>::Set(std::initializer_list<T> elems) {
-    for (const auto& elem : elems) {
-        insert(elem);
+template<class T, class Compare, class Allocator, class Policy>
+template<class V>
+std::pair<typename Set<T, Compare, Allocator, Policy>::Leaf*, bool>
+Set<T, Compare, Allocator, Policy>::insert_at_(Leaf* pos, V&& elem) {
+    if (pos != nullptr && !less_(pos->val, elem) && !less_(elem, pos->val)) {
+        return {pos, false};
     }
+    return {link_leaf_(pos, new_leaf_(std::forward<V>(elem))), true};
 }
 
-template<class T>
-typename Set<T>::Node* Set<T>::lower_bound_(const T& elem) {
-    Node* node = root_;
-    while (node->sons_size) {
-        if (!(*(node->sons[0]->val) < elem)) {
-            node = node->sons[0];
-        } else if (!(*(node->sons[1]->val) < elem) || node->sons_size == 2) {
-            node = node->sons[1];
-        } else {
-            node = node->sons[2];
+template<class T, class Compare, class Allocator, class Policy>
+std::pair<typename Set<T, Compare, Allocator, Policy>::Leaf*, bool>
+Set<T, Compare, Allocator, Policy>::insert_leaf_(Leaf* node) {
+    Leaf* pos = nullptr;
+    try {
+        if (root_ != nullptr) {
+            pos = lower_bound_(node->val);
+            if (!less_(pos->val, node->val) && !less_(node->val, pos->val)) {
+                delete_leaf_(node);
+                return {pos, false};
+            }
         }
+    } catch (...) {
+        delete_leaf_(node);
+        throw;
+    }
+    return {link_leaf_(pos, node), true};
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Leaf*
+Set<T, Compare, Allocator, Policy>::link_leaf_(Leaf* pos, Leaf* node) {
+    ++version_;
+    ++size_;
+    if (pos == nullptr) {
+        link_before_(&END_NODE_, node);
+        root_ = node;
+        return node;
+    }
+    // Only the new maximum goes after pos and changes keys above the leaf.
+    bool is_max = less_(pos->val, node->val);
+    link_before_(is_max ? pos->next : pos, node);
+    if (pos->parent == nullptr) {
+        Inner* root = new_inner_();
+        insert_son_(root, 0, pos);
+        insert_son_(root, is_max ? 1 : 0, node);
+        root_ = root;
+        return node;
     }
+    Inner* parent = pos->parent;
+    insert_son_(parent, pos->index + (is_max ? 1 : 0), node);
+    if (is_max) {
+        update_max_(parent);
+    }
+    add_size_(parent, 1);
+    fix_overflow_(parent);
     return node;
 }
 
-template<class T>
-typename Set<T>::Iterator Set<T>::lower_bound(const T& elem) const {
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::erase(const T& elem) {
+    erase_(elem);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K, class C, class>
+void Set<T, Compare, Allocator, Policy>::erase(const K& key) {
+    erase_(key);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class K>
+void Set<T, Compare, Allocator, Policy>::erase_(const K& key) {
     if (size_ == 0) {
-        return end();
+        return;
     }
-    const Node* node = root_;
-    while (node->sons_size) {
-        if (!(*(node->sons[0]->val) < elem)) {
-            node = node->sons[0];
-        } else if (!(*(node->sons[1]->val) < elem)) {
-            node = node->sons[1];
-        } else if (node->sons_size == 2 || *node->sons[2]->val < elem) {
-            return end();
+    Leaf* node = lower_bound_(key);
+    if (less_(node->val, key) || less_(key, node->val)) {
+        return;
+    }
+    erase_leaf_(node);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Iterator
+Set<T, Compare, Allocator, Policy>::erase(Iterator pos) {
+    pos.check_version_();
+    Link* leaf = const_cast<Link*>(pos.cur_);
+    Link* next = leaf->next;
+    erase_leaf_(static_cast<Leaf*>(leaf));
+    return Iterator(next, this);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Iterator
+Set<T, Compare, Allocator, Policy>::erase(Iterator first, Iterator last) {
+    first.check_version_();
+    last.check_version_();
+    Link* begin = const_cast<Link*>(first.cur_);
+    Link* end = const_cast<Link*>(last.cur_);
+    size_t count = 0;
+    for (const Link* leaf = begin; leaf != end; leaf = leaf->next) {
+        ++count;
+    }
+    if (count <= MAX_SONS) {
+        while (begin != end) {
+            Link* next = begin->next;
+            erase_leaf_(static_cast<Leaf*>(begin));
+            begin = next;
+        }
+        return Iterator(end, this);
+    }
+    // Without order statistics the parts are not counted. Their sizes only
+    // have to be non-zero for non-empty parts, since size_ is set at the end.
+    size_t new_size = size_ - count;
+    uint64_t version = version_;
+    bool to_end = (end == &END_NODE_);
+    size_t left_size = 0;
+    if (begin != END_NODE_.next) {
+        if constexpr (Policy::order_statistics) {
+            left_size = count_before_(begin);
         } else {
-            node = node->sons[2];
+            left_size = 1;
         }
     }
-    if (*node->val < elem) {
-        return end();
+    auto [left, rest] = split_(static_cast<Leaf*>(begin)->val, left_size);
+    if (!to_end) {
+        auto [middle, right] =
+            rest.split_(static_cast<Leaf*>(end)->val, count);
+        *this = join(std::move(left), std::move(right));
+    } else {
+        *this = std::move(left);
     }
-    return Iterator(node, this);
+    size_ = new_size;
+    version_ = version + 1;
+    return Iterator(to_end ? &END_NODE_ : end, this);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::erase_leaf_(Leaf* node) {
+    unlink_leaf_(node);
+    delete_leaf_(node);
 }
 
-template<class T>
-void Set<T>::fix4sons_(Set::Node* node) {
-    if (node->sons_size != 4) {
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::unlink_leaf_(Leaf* node) {
+    ++version_;
+    --size_;
+    unlink_(node);
+    node->prev = node->next = node;
+    if (node->parent == nullptr) {
+        root_ = nullptr;
         return;
     }
-    Node* node2 = new Node();
-    node2->sons[0] = node->sons[2];
-    node2->sons[1] = node->sons[3];
-    node2->sons_size = 2;
-    node->sons_size = 2;
-    update_(node2);
-    update_(node);
-    if (node == root_) {
-        root_ = new Node();
-        root_->sons[root_->sons_size++] = node;
-        root_->sons[root_->sons_size++] = node2;
-        update_(root_);
-        return;
+    Inner* parent = node->parent;
+    size_t pos = node->index;
+    erase_son_(parent, pos);
+    node->parent = nullptr;
+    node->index = 0;
+    if (pos == parent->sons_size) {
+        update_max_(parent);
     }
-    node->parent->sons[node->parent->sons_size++] = node2;
-    update_(node->parent);
-    fix4sons_(node->parent);
+    add_size_(parent, -1);
+    fix_underflow_(parent);
 }
 
-template<class T>
-void Set<T>::update_(Set::Node* node) {
-    if (node == nullptr) {
-        return;
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::InsertReturn
+Set<T, Compare, Allocator, Policy>::insert(NodeHandle&& node) {
+    if (node.empty()) {
+        return {end(), false, NodeHandle()};
     }
-    sort_sons(node);
-    for (size_t i = 0; i < node->sons_size; ++i) {
-        node->sons[i]->parent = node;
+    Leaf* pos = (root_ == nullptr ? nullptr : lower_bound_(node.leaf_->val));
+    if (pos != nullptr && !less_(pos->val, node.leaf_->val) &&
+        !less_(node.leaf_->val, pos->val)) {
+        return {Iterator(pos, this), false, std::move(node)};
+    }
+    Leaf* leaf = nullptr;
+    if (leaf_alloc_ == *node.alloc_) {
+        leaf = std::exchange(node.leaf_, nullptr);
+    } else {
+        // The leaf belongs to another allocator, so it can't be kept.
+        leaf = new_leaf_(std::move(node.leaf_->val));
+        node.reset_();
     }
-    node->val = node->sons[node->sons_size - 1]->val;
+    return {Iterator(link_leaf_(pos, leaf), this), true, NodeHandle()};
 }
 
-template<class T>
-void Set<T>::fix1sons_(Set::Node* node) {
-    if (node == nullptr) {
-        return;
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::NodeHandle
+Set<T, Compare, Allocator, Policy>::extract(const T& elem) {
+    if (size_ == 0) {
+        return NodeHandle();
     }
-    if (node->sons_size != 1) {
-        update_(node);
-        return fix1sons_(node->parent);
+    Leaf* node = lower_bound_(elem);
+    if (less_(node->val, elem) || less_(elem, node->val)) {
+        return NodeHandle();
     }
-    if (node == root_) {
-        root_ = node->sons[0];
-        root_->parent = nullptr;
-        delete node;
+    unlink_leaf_(node);
+    return NodeHandle(node, leaf_alloc_);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::NodeHandle
+Set<T, Compare, Allocator, Policy>::extract(Iterator pos) {
+    pos.check_version_();
+    Leaf* node = static_cast<Leaf*>(const_cast<Link*>(pos.cur_));
+    unlink_leaf_(node);
+    return NodeHandle(node, leaf_alloc_);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::merge(
+    Set<T, Compare, Allocator, Policy>& source) {
+    if (&source == this) {
         return;
     }
-    Node* bro = (node == node->parent->sons[1] ? node->parent->sons[0]
-                                               : node->parent->sons[1]);
-    bro->sons[bro->sons_size++] = node->sons[0];
-    size_t pos =
-        std::find(node->parent->sons.begin(),
-                  node->parent->sons.begin() + node->parent->sons_size, node) -
-        node->parent->sons.begin();
-    while (pos != node->parent->sons_size - 1) {
-        std::swap(node->parent->sons[pos], node->parent->sons[pos + 1]);
-        pos++;
-    }
-    node->parent->sons_size--;
-    delete node;
-    update_(bro);
-    fix4sons_(bro);
-    update_(bro->parent);
-    fix1sons_(bro->parent);
-}
-
-template<class T>
-void Set<T>::sort_sons(Set::Node* node) {
-    auto cmp = [](const Set::Node* a, const Set::Node* b) {
-        return *a->val < *b->val;
-    };
-    std::sort(node->sons.begin(), node->sons.begin() + node->sons_size, cmp);
+    // Leaves can move only between sets that can free each other's nodes.
+    bool relink = (leaf_alloc_ == source.leaf_alloc_);
+    Leaf* finger = nullptr;
+    Link* next = source.END_NODE_.next;
+    while (next != &source.END_NODE_) {
+        Leaf* node = static_cast<Leaf*>(next);
+        next = next->next;
+        Leaf* pos = nullptr;
+        if (root_ != nullptr) {
+            pos = (finger == nullptr ? lower_bound_(node->val)
+                                     : lower_bound_from_(finger, node->val));
+            if (!less_(pos->val, node->val) && !less_(node->val, pos->val)) {
+                finger = pos;
+                continue;
+            }
+        }
+        if (relink) {
+            source.unlink_leaf_(node);
+            finger = link_leaf_(pos, node);
+        } else {
+            Leaf* leaf = new_leaf_(std::move_if_noexcept(node->val));
+            source.erase_leaf_(node);
+            finger = link_leaf_(pos, leaf);
+        }
+    }
 }
 
-template<class T>
-typename Set<T>::Iterator Set<T>::find(const T& elem) const {
-    Iterator iter = lower_bound(elem);
-    if (iter == end()) {
-        return end();
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::merge(
+    Set<T, Compare, Allocator, Policy>&& source) {
+    merge(source);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class InputIterator>
+size_t Set<T, Compare, Allocator, Policy>::insert_sorted(InputIterator first,
+                                                         InputIterator last) {
+    size_t old_size = size_;
+    using Category =
+        typename std::iterator_traits<InputIterator>::iterator_category;
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag, Category>) {
+        size_t count = std::distance(first, last);
+        if (count * BULK_FACTOR >= size_) {
+            merge_sorted_(first, last, count);
+            return size_ - old_size;
+        }
     }
-    if (*iter < elem || elem < *iter) {
-        return end();
+    Leaf* finger = nullptr;
+    for (; first != last; ++first) {
+        if (root_ == nullptr) {
+            insert(*first);
+            continue;
+        }
+        Leaf* pos = (finger == nullptr ? lower_bound_(*first)
+                                       : lower_bound_from_(finger, *first));
+        finger = insert_at_(pos, *first).first;
     }
-    return iter;
+    return size_ - old_size;
 }
 
-template<class T>
-typename Set<T>::Iterator Set<T>::begin() const {
-    if (size_ == 0) {
-        return end();
+template<class T, class Compare, class Allocator, class Policy>
+template<class InputIterator>
+size_t Set<T, Compare, Allocator, Policy>::erase_sorted(InputIterator first,
+                                                        InputIterator last) {
+    size_t old_size = size_;
+    using Category =
+        typename std::iterator_traits<InputIterator>::iterator_category;
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag, Category>) {
+        size_t count = std::distance(first, last);
+        if (count * BULK_FACTOR >= size_) {
+            subtract_sorted_(first, last, count);
+            return old_size - size_;
+        }
     }
-    const Node* node = root_;
-    while (node->sons_size) {
-        node = node->sons[0];
+    // Finger is the last leaf less than the current key, if any.
+    Leaf* finger = nullptr;
+    for (; first != last && size_ != 0; ++first) {
+        Leaf* node = (finger == nullptr ? lower_bound_(*first)
+                                        : lower_bound_from_(finger, *first));
+        if (less_(node->val, *first)) {
+            finger = node;
+            continue;
+        }
+        Link* prev = node->prev;
+        finger = (prev == &END_NODE_ ? nullptr : static_cast<Leaf*>(prev));
+        if (!less_(*first, node->val)) {
+            erase_leaf_(node);
+        }
     }
-    return Iterator(node, this);
+    return old_size - size_;
 }
 
-template<class T>
-typename Set<T>::Iterator Set<T>::end() const {
-    return Iterator(&END_NODE_, this);
+template<class T, class Compare, class Allocator, class Policy>
+template<class ForwardIterator>
+void Set<T, Compare, Allocator, Policy>::merge_sorted_(ForwardIterator first,
+                                                       ForwardIterator last,
+                                                       size_t count) {
+    // New leaves are created before the tree is touched, so a failure
+    // leaves the set as it was.
+    std::vector<Node*> level;
+    level.reserve(size_ + count);
+    Link* cur = END_NODE_.next;
+    try {
+        for (; first != last; ++first) {
+            while (cur != &END_NODE_ &&
+                   less_(static_cast<Leaf*>(cur)->val, *first)) {
+                level.push_back(static_cast<Leaf*>(cur));
+                cur = cur->next;
+            }
+            if (cur != &END_NODE_ &&
+                !less_(*first, static_cast<Leaf*>(cur)->val)) {
+                continue;
+            }
+            if (!level.empty() && !less_(max_key_(level.back()), *first)) {
+                continue;
+            }
+            level.push_back(new_leaf_(*first));
+        }
+    } catch (...) {
+        // Old leaves appear in level in list order, the rest are new.
+        const Link* old = END_NODE_.next;
+        for (Node* node : level) {
+            if (node == old) {
+                old = old->next;
+            } else {
+                delete_leaf_(static_cast<Leaf*>(node));
+            }
+        }
+        throw;
+    }
+    for (; cur != &END_NODE_; cur = cur->next) {
+        level.push_back(static_cast<Leaf*>(cur));
+    }
+    if (level.size() == size_) {
+        return;
+    }
+    destruct_inners_(root_);
+    END_NODE_.prev = END_NODE_.next = &END_NODE_;
+    for (Node* node : level) {
+        node->parent = nullptr;
+        node->index = 0;
+        link_before_(&END_NODE_, static_cast<Leaf*>(node));
+    }
+    ++version_;
+    size_ = level.size();
+    build_(level);
 }
 
-template<class T>
-void Set<T>::insert(const T& elem) {
-    if (find(elem) != end()) {
+template<class T, class Compare, class Allocator, class Policy>
+template<class ForwardIterator>
+void Set<T, Compare, Allocator, Policy>::subtract_sorted_(
+    ForwardIterator first, ForwardIterator last, size_t count) {
+    // Survivors are found before the tree is touched, so a failure leaves
+    // the set as it was.
+    std::vector<Node*> level;
+    level.reserve(size_ > count ? size_ - count : 0);
+    Link* cur = END_NODE_.next;
+    for (; cur != &END_NODE_ && first != last; ++first) {
+        while (cur != &END_NODE_ &&
+               less_(static_cast<Leaf*>(cur)->val, *first)) {
+            level.push_back(static_cast<Leaf*>(cur));
+            cur = cur->next;
+        }
+        if (cur != &END_NODE_ &&
+            !less_(*first, static_cast<Leaf*>(cur)->val)) {
+            cur = cur->next;
+        }
+    }
+    for (; cur != &END_NODE_; cur = cur->next) {
+        level.push_back(static_cast<Leaf*>(cur));
+    }
+    if (level.size() == size_) {
         return;
     }
+    destruct_inners_(root_);
+    cur = END_NODE_.next;
+    END_NODE_.prev = END_NODE_.next = &END_NODE_;
+    size_t kept = 0;
+    while (cur != &END_NODE_) {
+        Link* next = cur->next;
+        if (kept < level.size() && level[kept] == cur) {
+            cur->parent = nullptr;
+            cur->index = 0;
+            link_before_(&END_NODE_, cur);
+            ++kept;
+        } else {
+            delete_leaf_(static_cast<Leaf*>(cur));
+        }
+        cur = next;
+    }
     ++version_;
-    ++size_;
-    Node* node = new Node(elem);
+    size_ = level.size();
+    build_(level);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+size_t Set<T, Compare, Allocator, Policy>::height_(const Node* root) {
+    size_t height = 0;
+    for (; root != nullptr && root->sons_size; ++height) {
+        root = static_cast<const Inner*>(root)->sons[0];
+    }
+    return height;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+size_t Set<T, Compare, Allocator, Policy>::count_before_(
+    const Link* leaf) const {
+    if (leaf == &END_NODE_) {
+        return size_;
+    }
+    if constexpr (Policy::order_statistics) {
+        size_t count = 0;
+        for (const Node* node = leaf; node->parent != nullptr;
+             node = node->parent) {
+            for (size_t i = 0; i < node->index; ++i) {
+                count += node->parent->sizes[i];
+            }
+        }
+        return count;
+    } else {
+        // Walks from both ends at once, so only the shorter part is visited.
+        const Link* forward = END_NODE_.next;
+        const Link* backward = leaf;
+        size_t count = 0;
+        while (forward != leaf && backward != &END_NODE_) {
+            forward = forward->next;
+            backward = backward->next;
+            ++count;
+        }
+        return forward == leaf ? count : size_ - count;
+    }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+size_t Set<T, Compare, Allocator, Policy>::attach_(size_t height, Node* tree,
+                                                   size_t tree_height,
+                                                   bool right) {
     if (root_ == nullptr) {
-        root_ = node;
-        return;
+        tree->parent = nullptr;
+        root_ = tree;
+        return tree_height;
     }
-    Node* pos = lower_bound_(elem);
-    if (pos->parent == nullptr) {
-        root_ = new Node();
-        root_->sons[root_->sons_size++] = pos;
-        root_->sons[root_->sons_size++] = node;
-        update_(root_);
-        return;
+    if (height == tree_height) {
+        Inner* root = new_inner_();
+        insert_son_(root, 0, right ? root_ : tree);
+        insert_son_(root, 1, right ? tree : root_);
+        root_ = root;
+        // Former roots may have less than MIN_SONS sons.
+        for (size_t i = 0; height > 0 && i < root->sons_size; ++i) {
+            Inner* son = static_cast<Inner*>(root->sons[i]);
+            if (son->sons_size < MIN_SONS) {
+                fix_underflow_(rebalance_(son));
+                break;
+            }
+        }
+        return height + (root_ == root ? 1 : 0);
+    }
+    // The lower tree becomes the border son of a node of the higher one.
+    Node* low = tree;
+    size_t low_height = tree_height;
+    if (height < tree_height) {
+        std::swap(root_, low);
+        std::swap(height, low_height);
+        right = !right;
+    }
+    Node* node = root_;
+    for (size_t h = height; h > low_height + 1; --h) {
+        Inner* inner = static_cast<Inner*>(node);
+        node = inner->sons[right ? inner->sons_size - 1 : 0];
+    }
+    Inner* parent = static_cast<Inner*>(node);
+    insert_son_(parent, right ? parent->sons_size : 0, low);
+    if (right) {
+        update_max_(parent);
+    }
+    if constexpr (Policy::order_statistics) {
+        add_size_(parent, subtree_size_(low));
+    }
+    // The lower tree's root may have less than MIN_SONS sons, and then it
+    // borrows from or merges with its brother.
+    if (low_height > 0 &&
+        static_cast<Inner*>(low)->sons_size < MIN_SONS &&
+        rebalance_(static_cast<Inner*>(low)) != nullptr) {
+        return height;
     }
-    pos->parent->sons[pos->parent->sons_size++] = node;
-    update_(pos->parent);
-    fix4sons_(pos->parent);
-    while (pos->parent != nullptr) {
-        pos = pos->parent;
-        update_(pos->parent);
+    Node* old_root = root_;
+    fix_overflow_(parent);
+    return height + (root_ != old_root ? 1 : 0);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::destruct_roots_(Node** first,
+                                                         Node** last) {
+    std::sort(first, last, std::less<Node*>());
+    last = std::unique(first, last);
+    for (; first != last; ++first) {
+        if (*first != nullptr && (*first)->parent == nullptr) {
+            destruct_(*first);
+        }
     }
 }
 
-template<class T>
-void Set<T>::erase(const T& elem) {
+template<class T, class Compare, class Allocator, class Policy>
+std::pair<Set<T, Compare, Allocator, Policy>,
+          Set<T, Compare, Allocator, Policy>>
+Set<T, Compare, Allocator, Policy>::split(const T& key) {
     if (size_ == 0) {
-        return;
+        return split_(key, 0);
     }
-    Node* node = lower_bound_(elem);
-    if (*node->val < elem || elem < *node->val) {
-        return;
+    return split_(key, count_before_(lower_link_(key)));
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+std::pair<Set<T, Compare, Allocator, Policy>,
+          Set<T, Compare, Allocator, Policy>>
+Set<T, Compare, Allocator, Policy>::split_(const T& key, size_t left_size) {
+    std::pair<Set, Set> res(Set(this->comp(), alloc_),
+                            Set(this->comp(), alloc_));
+    if (size_ == 0) {
+        return res;
     }
-    ++version_;
-    --size_;
-    if (node->parent == nullptr) {
-        delete node->val;
-        delete node;
-        root_ = nullptr;
-        return;
+    Set& left = res.first;
+    Set& right = res.second;
+
+    // Every node on the path to the key leaves its other sons as pieces of
+    // known height, which are joined back into two trees bottom-up. Heights
+    // of joined trees grow with the pieces, so all joins take O(log(n)).
+    size_t height = height_(root_);
+    std::vector<size_t> path;
+    std::vector<std::pair<Node*, size_t>> lefts;
+    std::vector<std::pair<Node*, size_t>> rights;
+    std::vector<Node*> roots;
+    path.reserve(height);
+    lefts.reserve(height * (MAX_SONS - 1) + 1);
+    rights.reserve(height * (MAX_SONS - 1) + 1);
+    roots.reserve(lefts.capacity() + rights.capacity() + 3);
+
+    Node* node = root_;
+    while (node->sons_size) {
+        Inner* inner = static_cast<Inner*>(node);
+        size_t i = std::min(lower_son_(inner, key), inner->sons_size - 1);
+        path.push_back(i);
+        node = inner->sons[i];
     }
-    Node* parent = node->parent;
-    size_t pos = std::find(parent->sons.begin(),
-                           parent->sons.begin() + parent->sons_size, node) -
-                 parent->sons.begin();
-    while (pos != parent->sons_size - 1) {
-        std::swap(parent->sons[pos], parent->sons[pos + 1]);
-        pos++;
+    bool leaf_left = less_(static_cast<Leaf*>(node)->val, key);
+    Link* boundary = (leaf_left ? static_cast<Leaf*>(node)->next
+                                : static_cast<Leaf*>(node));
+
+    // Pieces are joined starting from the back of the vectors, so left ones
+    // are stored in ascending order and right ones in descending order.
+    node = root_;
+    for (size_t depth = 0; depth < height; ++depth) {
+        Inner* inner = static_cast<Inner*>(node);
+        size_t sons_height = height - depth - 1;
+        for (size_t j = 0; j < inner->sons_size; ++j) {
+            inner->sons[j]->parent = nullptr;
+            inner->sons[j]->index = 0;
+        }
+        for (size_t j = 0; j < path[depth]; ++j) {
+            lefts.emplace_back(inner->sons[j], sons_height);
+        }
+        for (size_t j = inner->sons_size; j-- > path[depth] + 1;) {
+            rights.emplace_back(inner->sons[j], sons_height);
+        }
+        node = inner->sons[path[depth]];
+        delete_inner_(inner);
     }
-    parent->sons_size--;
+    node->parent = nullptr;
+    node->index = 0;
+    (leaf_left ? lefts : rights).emplace_back(node, 0);
+    root_ = nullptr;
+    ++version_;
 
-    delete node->val;
-    delete node;
-    update_(parent);
-    fix1sons_(parent);
-}
+    Node* before = nullptr;
+    try {
+        size_t left_height = 0;
+        for (size_t i = lefts.size(); i-- > 0;) {
+            before = left.root_;
+            left_height = left.attach_(left_height, lefts[i].first,
+                                       lefts[i].second, false);
+        }
+        size_t right_height = 0;
+        for (size_t i = rights.size(); i-- > 0;) {
+            before = right.root_;
+            right_height = right.attach_(right_height, rights[i].first,
+                                         rights[i].second, true);
+        }
+    } catch (...) {
+        // Pieces that are not joined yet still have no parent.
+        roots.push_back(left.root_);
+        roots.push_back(right.root_);
+        roots.push_back(before);
+        for (const auto& piece : lefts) {
+            roots.push_back(piece.first);
+        }
+        for (const auto& piece : rights) {
+            roots.push_back(piece.first);
+        }
+        left.root_ = right.root_ = nullptr;
+        destruct_roots_(roots.data(), roots.data() + roots.size());
+        size_ = 0;
+        END_NODE_.prev = END_NODE_.next = &END_NODE_;
+        throw;
+    }
 
-template<class T>
-const typename Set<T>::Node* Set<T>::next_node_(const Node* cur_) const {
-    const Node* son = cur_;
-    const Node* par = cur_->parent;
-    while (par != nullptr && son == par->sons[par->sons_size - 1]) {
-        par = par->parent;
-        son = son->parent;
+    if (boundary != END_NODE_.next) {
+        left.END_NODE_.next = END_NODE_.next;
+        left.END_NODE_.prev = boundary->prev;
+        left.END_NODE_.next->prev = left.END_NODE_.prev->next =
+            &left.END_NODE_;
     }
-    if (par == nullptr) {
-        return &END_NODE_;
+    if (boundary != &END_NODE_) {
+        right.END_NODE_.next = boundary;
+        right.END_NODE_.prev = END_NODE_.prev;
+        right.END_NODE_.next->prev = right.END_NODE_.prev->next =
+            &right.END_NODE_;
     }
-    son = *(std::find(par->sons.begin(),
-                      par->sons.begin() + par->sons_size, son) + 1);
-    while (son->sons_size) {
-        son = son->sons[0];
+    END_NODE_.prev = END_NODE_.next = &END_NODE_;
+    left.size_ = left_size;
+    right.size_ = size_ - left_size;
+    size_ = 0;
+    return res;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy> Set<T, Compare, Allocator, Policy>::join(
+    Set<T, Compare, Allocator, Policy>&& lhs,
+    Set<T, Compare, Allocator, Policy>&& rhs) {
+    Set res(std::move(lhs));
+    Set other(std::move(rhs));
+    if (other.size_ == 0) {
+        return res;
     }
-    if (son->val == nullptr) {
-        throw std::exception();
+    if (!(res.alloc_ == other.alloc_)) {
+        res.insert_sorted(other.begin(), other.end());
+        return res;
     }
-    return son;
+    std::array<Node*, 3> roots = {res.root_, other.root_, nullptr};
+    try {
+        res.attach_(height_(res.root_), other.root_, height_(other.root_),
+                    true);
+    } catch (...) {
+        roots[2] = res.root_;
+        res.root_ = other.root_ = nullptr;
+        res.destruct_roots_(roots.data(), roots.data() + roots.size());
+        res.size_ = other.size_ = 0;
+        res.END_NODE_.prev = res.END_NODE_.next = &res.END_NODE_;
+        other.END_NODE_.prev = other.END_NODE_.next = &other.END_NODE_;
+        throw;
+    }
+    other.root_ = nullptr;
+    res.END_NODE_.prev->next = other.END_NODE_.next;
+    other.END_NODE_.next->prev = res.END_NODE_.prev;
+    res.END_NODE_.prev = other.END_NODE_.prev;
+    res.END_NODE_.prev->next = &res.END_NODE_;
+    other.END_NODE_.prev = other.END_NODE_.next = &other.END_NODE_;
+    res.size_ += other.size_;
+    other.size_ = 0;
+    ++res.version_;
+    return res;
 }
 
-template<class T>
-const typename Set<T>::Node* Set<T>::prev_node_(const Node* cur_) const {
-    if (cur_ == &END_NODE_) {
-        cur_ = root_;
-        while (cur_->sons_size) {
-            cur_ = cur_->sons[cur_->sons_size - 1];
+template<class T, class Compare, class Allocator, class Policy>
+template<class F>
+void Set<T, Compare, Allocator, Policy>::merge_(const Set& a, const Set& b,
+                                                bool only_a, bool only_b,
+                                                bool both, F&& push) {
+    const Link* i = a.END_NODE_.next;
+    const Link* j = b.END_NODE_.next;
+    while (i != &a.END_NODE_ && j != &b.END_NODE_) {
+        const T& x = static_cast<const Leaf*>(i)->val;
+        const T& y = static_cast<const Leaf*>(j)->val;
+        if (a.less_(x, y)) {
+            if (only_a) {
+                push(x);
+                i = i->next;
+            } else {
+                i = a.lower_link_from_(i, y);
+            }
+        } else if (a.less_(y, x)) {
+            if (only_b) {
+                push(y);
+                j = j->next;
+            } else {
+                j = b.lower_link_from_(j, x);
+            }
+        } else {
+            if (both) {
+                push(x);
+            }
+            i = i->next;
+            j = j->next;
         }
-        return cur_;
     }
-    const Node* son = cur_;
-    const Node* par = cur_->parent;
-    while (par != nullptr && son == par->sons[0]) {
-        par = par->parent;
-        son = son->parent;
+    for (; only_a && i != &a.END_NODE_; i = i->next) {
+        push(static_cast<const Leaf*>(i)->val);
     }
-    if (par == nullptr) {
-        return &END_NODE_;
+    for (; only_b && j != &b.END_NODE_; j = j->next) {
+        push(static_cast<const Leaf*>(j)->val);
     }
-    son = *(std::find(par->sons.begin(),
-                      par->sons.begin() + par->sons_size, son) - 1);
-    while (son->sons_size) {
-        son = son->sons[son->sons_size - 1];
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>
+Set<T, Compare, Allocator, Policy>::set_union(
+    const Set<T, Compare, Allocator, Policy>& a,
+    const Set<T, Compare, Allocator, Policy>& b) {
+    Set res(a.comp(),
+            KeyTraits::select_on_container_copy_construction(a.alloc_));
+    std::vector<Node*> level;
+    level.reserve(a.size_ + b.size_);
+    res.build_from_(level, [&a, &b](auto& push) {
+        merge_(a, b, true, true, true, push);
+    });
+    return res;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>
+Set<T, Compare, Allocator, Policy>::set_union(
+    Set<T, Compare, Allocator, Policy>&& a,
+    Set<T, Compare, Allocator, Policy>&& b) {
+    if (a.size_ == 0 || b.size_ == 0) {
+        return join(std::move(a), std::move(b));
     }
-    return son;
+    const T& a_min = static_cast<const Leaf*>(a.END_NODE_.next)->val;
+    const T& a_max = static_cast<const Leaf*>(a.END_NODE_.prev)->val;
+    const T& b_min = static_cast<const Leaf*>(b.END_NODE_.next)->val;
+    const T& b_max = static_cast<const Leaf*>(b.END_NODE_.prev)->val;
+    if (a.less_(a_max, b_min)) {
+        return join(std::move(a), std::move(b));
+    }
+    if (a.less_(b_max, a_min)) {
+        return join(std::move(b), std::move(a));
+    }
+    bool a_bigger = (a.size_ >= b.size_);
+    Set res(std::move(a_bigger ? a : b));
+    Set rest(std::move(a_bigger ? b : a));
+    res.insert_sorted(rest.begin(), rest.end());
+    return res;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>
+Set<T, Compare, Allocator, Policy>::set_intersection(
+    const Set<T, Compare, Allocator, Policy>& a,
+    const Set<T, Compare, Allocator, Policy>& b) {
+    Set res(a.comp(),
+            KeyTraits::select_on_container_copy_construction(a.alloc_));
+    std::vector<Node*> level;
+    level.reserve(std::min(a.size_, b.size_));
+    res.build_from_(level, [&a, &b](auto& push) {
+        merge_(a, b, false, false, true, push);
+    });
+    return res;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>
+Set<T, Compare, Allocator, Policy>::set_difference(
+    const Set<T, Compare, Allocator, Policy>& a,
+    const Set<T, Compare, Allocator, Policy>& b) {
+    Set res(a.comp(),
+            KeyTraits::select_on_container_copy_construction(a.alloc_));
+    std::vector<Node*> level;
+    level.reserve(a.size_);
+    res.build_from_(level, [&a, &b](auto& push) {
+        merge_(a, b, true, false, false, push);
+    });
+    return res;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>
+Set<T, Compare, Allocator, Policy>::set_difference(
+    Set<T, Compare, Allocator, Policy>&& a,
+    const Set<T, Compare, Allocator, Policy>& b) {
+    Set res(std::move(a));
+    if (res.size_ * BULK_FACTOR < b.size_) {
+        return set_difference(static_cast<const Set&>(res), b);
+    }
+    res.erase_sorted(b.begin(), b.end());
+    return res;
 }
 
-template<class T>
-typename Set<T>::Node* Set<T>::copy_(const Node* root) {
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Node*
+Set<T, Compare, Allocator, Policy>::copy_(const Node* root, Link& list) {
     if (root == nullptr) {
         return nullptr;
     }
-    Node* new_root = new Node();
     if (!root->sons_size) {
-        new_root->val = new T(*root->val);
+        Leaf* leaf = new_leaf_(static_cast<const Leaf*>(root)->val);
+        link_before_(&list, leaf);
+        return leaf;
     }
-    for (size_t i = 0; i < root->sons_size; ++i) {
-        new_root->sons[i] = copy_(root->sons[i]);
-        new_root->sons[i]->parent = new_root;
+    // Copies of the nodes on the path, each gets its sons one by one. A son
+    // is attached when its subtree is done, since its max key is needed.
+    std::array<std::pair<const Inner*, Inner*>, MAX_HEIGHT> path;
+    size_t depth = 0;
+    Node* son = nullptr;
+    try {
+        path[depth++] = {static_cast<const Inner*>(root), new_inner_()};
+        for (;;) {
+            auto [src, dst] = path[depth - 1];
+            if (son != nullptr) {
+                insert_son_(dst, dst->sons_size, son);
+                son = nullptr;
+            }
+            if (dst->sons_size == src->sons_size) {
+                son = dst;
+                if (--depth == 0) {
+                    break;
+                }
+                continue;
+            }
+            const Node* next = src->sons[dst->sons_size];
+            if (next->sons_size == 0) {
+                Leaf* leaf = new_leaf_(static_cast<const Leaf*>(next)->val);
+                link_before_(&list, leaf);
+                son = leaf;
+            } else {
+                path[depth] = {static_cast<const Inner*>(next), new_inner_()};
+                ++depth;
+            }
+        }
+    } catch (...) {
+        destruct_(son);
+        while (depth > 0) {
+            Inner* node = path[--depth].second;
+            for (size_t i = 0; i < node->sons_size; ++i) {
+                destruct_(node->sons[i]);
+            }
+            delete_inner_(node);
+        }
+        throw;
     }
-    update_(new_root);
-    return new_root;
+    return son;
 }
 
-template<class T>
-Set<T>::Set(const Set<T>& s) {
-    root_ = nullptr;
-    size_ = 0;
-    for (const auto& item : s) {
-        insert(item);
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Node*
+Set<T, Compare, Allocator, Policy>::parallel_copy_(const Node* root,
+                                                   size_t size) {
+    size_t tasks = parallel_tasks_(size, ALLOC_THREADS);
+    if (tasks <= 1) {
+        return copy_(root, END_NODE_);
+    }
+    size_t depth = 0;
+    std::vector<Node*> tops =
+        frontier_(const_cast<Node*>(root), tasks, depth);
+    std::vector<Node*> pieces(tops.size(), nullptr);
+    std::unique_ptr<Link[]> lists(new Link[tops.size()]);
+    size_t used = 0;
+    try {
+        parallel_run_(tops.size(), ALLOC_THREADS, [&](size_t i) {
+            pieces[i] = copy_(tops[i], lists[i]);
+        });
+        for (size_t i = 0; i < tops.size(); ++i) {
+            splice_before_(&END_NODE_, lists[i]);
+        }
+        return copy_top_(root, depth, pieces.data(), used);
+    } catch (...) {
+        for (size_t i = used; i < pieces.size(); ++i) {
+            destruct_(pieces[i]);
+        }
+        END_NODE_.prev = END_NODE_.next = &END_NODE_;
+        throw;
+    }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Node*
+Set<T, Compare, Allocator, Policy>::copy_top_(const Node* root,
+                                              size_t depth,
+                                              Node* const* pieces,
+                                              size_t& used) {
+    if (depth == 0) {
+        return pieces[used++];
+    }
+    const Inner* inner = static_cast<const Inner*>(root);
+    Inner* new_root = new_inner_();
+    Node* son = nullptr;
+    try {
+        for (size_t i = 0; i < inner->sons_size; ++i) {
+            son = copy_top_(inner->sons[i], depth - 1, pieces, used);
+            insert_son_(new_root, i, son);
+            son = nullptr;
+        }
+    } catch (...) {
+        destruct_(son);
+        for (size_t i = 0; i < new_root->sons_size; ++i) {
+            destruct_(new_root->sons[i]);
+        }
+        delete_inner_(new_root);
+        throw;
     }
+    return new_root;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>::Set(
+    const Set<T, Compare, Allocator, Policy>& s)
+    : CompareHolder<Compare>(s),
+      // Counters of the copy start at zero.
+      CounterHolder<Policy::counters>(),
+      alloc_(KeyTraits::select_on_container_copy_construction(s.alloc_)),
+      leaf_alloc_(alloc_),
+      inner_alloc_(alloc_) {
+    root_ = parallel_copy_(s.root_, s.size_);
+    size_ = s.size_;
 }
 
-template<class T>
-Set<T>& Set<T>::operator=(const Set<T>& s) {
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>&
+Set<T, Compare, Allocator, Policy>::operator=(
+    const Set<T, Compare, Allocator, Policy>& s) {
     if (this == &s) {
         return *this;
     }
-    destruct_(root_);
-    root_ = nullptr;
-    size_ = 0;
-    for (const auto& item : s) {
-        insert(item);
-    }
+    Set<T, Compare, Allocator, Policy> copy(s.comp(), alloc_);
+    copy.root_ = copy.parallel_copy_(s.root_, s.size_);
+    copy.size_ = s.size_;
+    std::swap(static_cast<CompareHolder<Compare>&>(copy),
+              static_cast<CompareHolder<Compare>&>(*this));
+    std::swap(copy.root_, root_);
+    std::swap(copy.size_, size_);
+    Link list;
+    move_list_(END_NODE_, list);
+    move_list_(copy.END_NODE_, END_NODE_);
+    move_list_(list, copy.END_NODE_);
     version_++;
     return *this;
 }
 
-template<class T>
-Set<T>::~Set() {
-    destruct_(root_);
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>::~Set() {
+    if (drops_with_arena_()) {
+        return;
+    }
+    parallel_destruct_(root_, size_);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+bool Set<T, Compare, Allocator, Policy>::drops_with_arena_() const {
+    if constexpr (is_pool_allocator<Allocator>::value &&
+                  std::is_trivially_destructible_v<T>) {
+        // Nodes are dropped in O(1) only if the arena is owned by this set
+        // alone. Copies sharing the allocator, sets split off this one and
+        // node handles extracted from it keep the arena alive, and then
+        // every node is destroyed.
+        return alloc_.arena_use_count() == ALLOCATORS;
+    } else {
+        return false;
+    }
 }
 
-template<class T>
-void Set<T>::destruct_(Set::Node* root) {
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::destruct_(Node* root) {
     if (root == nullptr) {
         return;
     }
-    for (size_t i = 0; i < root->sons_size; ++i) {
-        destruct_(root->sons[i]);
+    // Internal nodes on the path with the index of the next son to delete.
+    // Leaves go in key order, which is allocation order of built trees.
+    std::array<std::pair<Inner*, size_t>, MAX_HEIGHT> path;
+    size_t depth = 0;
+    Node* node = root;
+    for (;;) {
+        if (node->sons_size == 0) {
+            delete_leaf_(static_cast<Leaf*>(node));
+        } else {
+            path[depth++] = {static_cast<Inner*>(node), 0};
+        }
+        while (depth > 0 &&
+               path[depth - 1].second == path[depth - 1].first->sons_size) {
+            delete_inner_(path[--depth].first);
+        }
+        if (depth == 0) {
+            return;
+        }
+        node = path[depth - 1].first->sons[path[depth - 1].second++];
+    }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::parallel_destruct_(Node* root,
+                                                            size_t size) {
+    size_t tasks = parallel_tasks_(size, ALLOC_THREADS);
+    if (tasks <= 1) {
+        destruct_(root);
+        return;
+    }
+    size_t depth = 0;
+    std::vector<Node*> tops = frontier_(root, tasks, depth);
+    parallel_run_(tops.size(), ALLOC_THREADS,
+                  [this, &tops](size_t i) { destruct_(tops[i]); });
+    destruct_top_(root, depth);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::destruct_top_(Node* root,
+                                                       size_t depth) {
+    if (depth == 0) {
+        return;
+    }
+    Inner* inner = static_cast<Inner*>(root);
+    for (size_t i = 0; i < inner->sons_size; ++i) {
+        destruct_top_(inner->sons[i], depth - 1);
+    }
+    delete_inner_(inner);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+size_t Set<T, Compare, Allocator, Policy>::threads_(size_t threads) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    return std::max<size_t>(threads, 1);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+size_t Set<T, Compare, Allocator, Policy>::parallel_tasks_(size_t n,
+                                                           size_t threads) {
+    threads = threads_(threads);
+    if (threads == 1) {
+        return 1;
+    }
+    // A few tasks per thread even out subtrees of different sizes.
+    return std::max<size_t>(std::min(threads * 4, n / PARALLEL_GRAIN), 1);
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+template<class F>
+void Set<T, Compare, Allocator, Policy>::parallel_run_(size_t tasks,
+                                                       size_t threads,
+                                                       F&& fn) {
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+    auto work = [&]() {
+        for (size_t i = next++; i < tasks && !failed; i = next++) {
+            try {
+                fn(i);
+            } catch (...) {
+                if (!failed.exchange(true)) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    size_t count = std::min(threads_(threads), tasks);
+    // Threads that could not be started leave their tasks to others.
+    try {
+        pool.reserve(count - 1);
+        for (size_t i = 1; i < count; ++i) {
+            pool.emplace_back(work);
+        }
+    } catch (...) {
+    }
+    work();
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+std::vector<typename Set<T, Compare, Allocator, Policy>::Node*>
+Set<T, Compare, Allocator, Policy>::frontier_(Node* root, size_t count,
+                                              size_t& depth) {
+    std::vector<Node*> level{root};
+    std::vector<Node*> next;
+    depth = 0;
+    while (level.size() < count && level[0]->sons_size != 0) {
+        next.clear();
+        for (Node* node : level) {
+            Inner* inner = static_cast<Inner*>(node);
+            next.insert(next.end(), inner->sons.begin(),
+                        inner->sons.begin() + inner->sons_size);
+        }
+        level.swap(next);
+        ++depth;
+    }
+    return level;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::splice_before_(Link* next,
+                                                        Link& list) {
+    if (list.next == &list) {
+        return;
+    }
+    list.next->prev = next->prev;
+    next->prev->next = list.next;
+    list.prev->next = next;
+    next->prev = list.prev;
+    list.prev = list.next = &list;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::destruct_inners_(Node* root) {
+    if (root == nullptr || root->sons_size == 0) {
+        return;
     }
-    if (root->sons_size == 0) {
-        delete root->val;
+    Inner* inner = static_cast<Inner*>(root);
+    for (size_t i = 0; i < inner->sons_size; ++i) {
+        destruct_inners_(inner->sons[i]);
     }
-    delete root;
+    delete_inner_(inner);
 }
 
-template<class T>
-Set<T>::Set(Set<T>&& s) noexcept {
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>::Set(
+    Set<T, Compare, Allocator, Policy>&& s) noexcept
+    : CompareHolder<Compare>(s),
+      alloc_(s.alloc_),
+      leaf_alloc_(s.leaf_alloc_),
+      inner_alloc_(s.inner_alloc_) {
+    // Allocators are copied, which doesn't throw, so s can still allocate.
     std::swap(s.root_, root_);
     std::swap(s.size_, size_);
     std::swap(s.version_, version_);
-    std::swap(s.END_NODE_, END_NODE_);
+    move_list_(s.END_NODE_, END_NODE_);
 }
 
-template<class T>
-Set<T>& Set<T>::operator=(Set<T>&& s) noexcept {
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>&
+Set<T, Compare, Allocator, Policy>::operator=(
+    Set<T, Compare, Allocator, Policy>&& s) noexcept {
     if (this == &s) {
         return *this;
     }
+    std::swap(static_cast<CompareHolder<Compare>&>(s),
+              static_cast<CompareHolder<Compare>&>(*this));
+    std::swap(s.alloc_, alloc_);
+    std::swap(s.leaf_alloc_, leaf_alloc_);
+    std::swap(s.inner_alloc_, inner_alloc_);
     std::swap(s.root_, root_);
     std::swap(s.size_, size_);
     std::swap(s.version_, version_);
-    std::swap(s.END_NODE_, END_NODE_);
+    Link list;
+    move_list_(END_NODE_, list);
+    move_list_(s.END_NODE_, END_NODE_);
+    move_list_(list, s.END_NODE_);
+    return *this;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>::NodeHandle::NodeHandle(
+    NodeHandle&& other) noexcept
+    : leaf_(std::exchange(other.leaf_, nullptr)),
+      alloc_(std::move(other.alloc_)) {}
+
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::NodeHandle&
+Set<T, Compare, Allocator, Policy>::NodeHandle::operator=(
+    NodeHandle&& other) noexcept {
+    if (this != &other) {
+        reset_();
+        leaf_ = std::exchange(other.leaf_, nullptr);
+        alloc_ = std::move(other.alloc_);
+    }
     return *this;
 }
 
-template<class T>
-Set<T>::Iterator::Iterator(const Set<T>::Node* node, const Set<T>* s)
-    : cur_(node), s_(s), version_(s->version_) {}
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>::NodeHandle::~NodeHandle() {
+    reset_();
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+void Set<T, Compare, Allocator, Policy>::NodeHandle::reset_() {
+    if (leaf_ == nullptr) {
+        return;
+    }
+    LeafTraits::destroy(*alloc_, leaf_);
+    LeafTraits::deallocate(*alloc_, leaf_, 1);
+    leaf_ = nullptr;
+}
+
+template<class T, class Compare, class Allocator, class Policy>
+Set<T, Compare, Allocator, Policy>::Iterator::Iterator(
+    const Link* node, const Set<T, Compare, Allocator, Policy>* s)
+    : cur_(node) {
+#if SET_CHECK_ITERATORS
+    s_ = s;
+    version_ = s->version_;
+#else
+    static_cast<void>(s);
+#endif
+}
 
-template<class T>
-void Set<T>::Iterator::check_version_() const {
+template<class T, class Compare, class Allocator, class Policy>
+inline void
+Set<T, Compare, Allocator, Policy>::Iterator::check_version_() const {
+#if SET_CHECK_ITERATORS
     if (version_ != s_->version_) {
         throw std::out_of_range("invalid iterator");
     }
+#endif
 }
 
-template<class T>
-typename Set<T>::Iterator& Set<T>::Iterator::operator++() {
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Iterator&
+Set<T, Compare, Allocator, Policy>::Iterator::operator++() {
     check_version_();
-    cur_ = s_->next_node_(cur_);
+    cur_ = cur_->next;
     return *this;
 }
 
-template<class T>
-typename Set<T>::Iterator& Set<T>::Iterator::operator--() {
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Iterator&
+Set<T, Compare, Allocator, Policy>::Iterator::operator--() {
     check_version_();
-    cur_ = s_->prev_node_(cur_);
+    cur_ = cur_->prev;
     return *this;
 }
 
-template<class T>
-bool Set<T>::Iterator::operator!=(const typename Set<T>::Iterator& iter) const {
+template<class T, class Compare, class Allocator, class Policy>
+bool Set<T, Compare, Allocator, Policy>::Iterator::operator!=(
+    const typename Set<T, Compare, Allocator, Policy>::Iterator& iter) const {
     check_version_();
-    return s_ != iter.s_ || cur_ != iter.cur_;
+    return cur_ != iter.cur_;
 }
 
-template<class T>
-const T& Set<T>::Iterator::operator*() const {
+template<class T, class Compare, class Allocator, class Policy>
+const T& Set<T, Compare, Allocator, Policy>::Iterator::operator*() const {
     check_version_();
-    return *cur_->val;
+    return static_cast<const Leaf*>(cur_)->val;
 }
 
-template<class T>
-bool Set<T>::Iterator::operator==(const Iterator& iter) const {
-    check_version_();
+template<class T, class Compare, class Allocator, class Policy>
+bool Set<T, Compare, Allocator, Policy>::Iterator::operator==(
+    const Iterator& iter) const {
     return !operator!=(iter);
 }
 
-template<class T>
-T* Set<T>::Iterator::operator->() {
+template<class T, class Compare, class Allocator, class Policy>
+const T* Set<T, Compare, Allocator, Policy>::Iterator::operator->() const {
     check_version_();
-    return cur_->val;
+    return &static_cast<const Leaf*>(cur_)->val;
 }
 
-template<class T>
-typename Set<T>::Iterator Set<T>::Iterator::operator++(int) {
-    check_version_();
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Iterator
+Set<T, Compare, Allocator, Policy>::Iterator::operator++(int) {
     Iterator copy = *this;
     this->operator++();
     return copy;
 }
 
-template<class T>
-typename Set<T>::Iterator Set<T>::Iterator::operator--(int) {
-    check_version_();
+template<class T, class Compare, class Allocator, class Policy>
+typename Set<T, Compare, Allocator, Policy>::Iterator
+Set<T, Compare, Allocator, Policy>::Iterator::operator--(int) {
     Iterator copy = *this;
     this->operator--();
     return copy;